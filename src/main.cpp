@@ -6,16 +6,36 @@
 #include <vector>
 #include <filesystem>
 #include <chrono>
+#include <ctime>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <memory>
 
 #include "tclap/CmdLine.h"
 
 #include "maxsat.hpp"
 #include "mc.hpp"
+#include "marginals.hpp"
+#include "scheduler.hpp"
 
 using namespace std;
 using namespace TCLAP;
 namespace fs = std::filesystem;
 
+struct FileResult {
+    bool done;
+    int score;
+    double time;
+    size_t treeNodes, treeBytes, peakTreeBytes;
+    long long nbEvicted, nbReleased;
+    long long nbConflicts;
+    bool marginalsSurvey, marginalsConverged;
+    int marginalsIterations;
+};
+
 vector<string> split(const string &s, char delim) {
     vector<string> result{};
     stringstream ss(s);
@@ -58,6 +78,75 @@ SatProblem readSatProblem(string filepath) {
     return SatProblem(clauses, nVars);
 }
 
+// Parses the files in order on a background thread, at most depth problems ahead of the solvers (0 to parse when asked)
+struct ProblemLoader {
+    const vector<string>& files;
+    size_t depth;
+    deque<pair<int, unique_ptr<SatProblem>>> ready;
+    int nbTaken;
+    bool stopping;
+    mutex lock;
+    condition_variable changed;
+    thread loader;
+
+    ProblemLoader(const vector<string>& _files, int _depth) : files(_files), depth(max(0, _depth)), nbTaken(0), stopping(false) {
+        if (depth > 0) {
+            loader = thread(&ProblemLoader::loadAll, this);
+        }
+    }
+
+    ~ProblemLoader() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        changed.notify_all();
+        if (loader.joinable()) {
+            loader.join();
+        }
+    }
+
+    void loadAll() {
+        for (int iFile = 0; iFile < (int)files.size(); iFile++) {
+            {
+                unique_lock<mutex> waiting(lock);
+                changed.wait(waiting, [&]() { return stopping || ready.size() < depth; });
+                if (stopping) {
+                    return;
+                }
+            }
+            auto problem = make_unique<SatProblem>(readSatProblem(files[iFile]));
+            lock_guard<mutex> guard(lock);
+            ready.push_back({iFile, move(problem)});
+            changed.notify_all();
+        }
+    }
+
+    bool next(int& iFile, unique_ptr<SatProblem>& problem) {
+        /* Next file in order and its problem, false once all the files were taken */
+        unique_lock<mutex> waiting(lock);
+        if (depth == 0) {
+            if (nbTaken == (int)files.size()) {
+                return false;
+            }
+            iFile = nbTaken++;
+            waiting.unlock();
+            problem = make_unique<SatProblem>(readSatProblem(files[iFile]));
+            return true;
+        }
+        changed.wait(waiting, [&]() { return !ready.empty() || nbTaken == (int)files.size(); });
+        if (ready.empty()) {
+            return false;
+        }
+        iFile = ready.front().first;
+        problem = move(ready.front().second);
+        ready.pop_front();
+        nbTaken++;
+        changed.notify_all();
+        return true;
+    }
+};
+
 int main(int argc, char** argv) {
     cout << C_CYAN;
     for (const string& part : vector<string>(argv, argv+argc)) {
@@ -67,6 +156,9 @@ int main(int argc, char** argv) {
 
     string method = "rollout";
     string dataPath = "data/test";
+    bool portfolio = false;
+    int jobs = 1;
+    int prefetch = 2;
     MCSettings settings{};
 
     vector<string> methodsList{"rollout", "mcts", "nested_mc", "seq_halving"};
@@ -75,8 +167,16 @@ int main(int argc, char** argv) {
     ValuesConstraint<string> behaviorsConstraint(behaviors);
     vector<string> flipAlgorithms{"walksat", "novelty"};
     ValuesConstraint<string> flipAlgorithmsConstraint(flipAlgorithms);
-    vector<int> heuristicList{0, 1, 2, 3};
+    vector<string> parallelModes{"root", "tree"};
+    ValuesConstraint<string> parallelModesConstraint(parallelModes);
+    vector<string> leafReduces{"min", "mean"};
+    ValuesConstraint<string> leafReducesConstraint(leafReduces);
+    vector<int> heuristicList{0, 1, 2, 3, 5, 6};
     ValuesConstraint<int> heuristicConstraint(heuristicList);
+    vector<int> nodeHeuristicList{0, 1, 2, 3, 4, 5};
+    ValuesConstraint<int> nodeHeuristicConstraint(nodeHeuristicList);
+    vector<int> rolloutCacheList{0, 1, 2};
+    ValuesConstraint<int> rolloutCacheConstraint(rolloutCacheList);
 
 	try {
 	    CmdLine cmd("Run MC experiment", ' ', "0.0");
@@ -95,22 +195,37 @@ int main(int argc, char** argv) {
             false, settings.nodeNActionVars, "integer", cmd);
 
     	ValueArg<int> nodeActionVarsHeuristicArg("", "node_h",
-            "Heuristic used to sort the next actions from a node (0=random, 1,2,3=H1,H2,H3)",
-            false, settings.nodeActionVarsHeuristic, &heuristicConstraint, cmd);
+            "Heuristic used to sort the next actions from a node (0=random, 1,2,3=H1,H2,H3, 4=unit propagation lookahead, 5=SP/BP marginals)",
+            false, settings.nodeActionVarsHeuristic, &nodeHeuristicConstraint, cmd);
 
         SwitchArg nodeActionHeuristicDynamicSwitch("", "node_h_dyn",
             "Use the dynamic heuristic for the node action heuristic", cmd, false);
 
     	ValueArg<int> rolloutHeuristicArg("", "rollout_h",
-            "Heuristic used for the rollout initialization (0=random, 1,2,3=H1,H2,H3)",
+            "Heuristic used for the rollout initialization (0=random, 1,2,3=H1,H2,H3, 5=SP/BP marginals, 6=phase saving from the best assignments)",
             false, settings.rolloutHeuristic, &heuristicConstraint, cmd);
 
         SwitchArg dynamicHeuristicSwitch("", "rollout_h_dyn",
             "Use the dynamic heuristic for the rollout heuristic", cmd, false);
+
+        SwitchArg rolloutPropagationSwitch("", "rollout_up",
+            "Run unit propagation after each assignment of the rollout heuristic (in the static order of the heuristic)", cmd, false);
+
+    	ValueArg<int> rolloutCacheArg("", "rollout_cache",
+            "Cache the rollout heuristic completion of each node (0=no, 1=completion, 2=completion and clause counts), for the deterministic heuristics",
+            false, settings.rolloutCache, &rolloutCacheConstraint, cmd);
+
+    	ValueArg<int> phasePoolArg("", "phase_pool",
+            "Number of best assignments the phase saving heuristic starts from",
+            false, settings.phasePool, "integer", cmd);
+
+    	ValueArg<float> phaseEpsArg("", "phase_eps",
+            "Probability for each variable of the phase saving heuristic to take a random value",
+            false, settings.phaseEps, "float [0;1]", cmd);
         
     	ValueArg<string> flipAlgorithmArg("", "flip",
             "Flip algorithm used to optimize the solutions",
-            false, settings.flipAlgorithm, &flipAlgorithmsConstraint, cmd);
+            false, flipAlgorithms[(int)settings.flipAlgorithm], &flipAlgorithmsConstraint, cmd);
         
     	ValueArg<int> walkBudgetPerVarArg("w", "w_var",
             "WalkSat budget per variable",
@@ -134,7 +249,7 @@ int main(int argc, char** argv) {
         
     	ValueArg<string> behaviorArg("", "behavior",
             "MCTS behavior (once only run from the root, discounted is faster than full)",
-            false, settings.behavior, &behaviorsConstraint, cmd);
+            false, behaviors[(int)settings.behavior], &behaviorsConstraint, cmd);
         
     	ValueArg<int> stepsArg("n", "steps",
             "Number of steps for the MCTS algorithm, budget for the Sequential Halving algorithm, number of repeats of the NMCS or rollout algorithms",
@@ -144,6 +259,55 @@ int main(int argc, char** argv) {
             "Depth for the nested MC algorithm",
             false, settings.nmcsDepth, "integer", cmd);
         
+    	ValueArg<int> treeMemoryArg("", "tree_mem",
+            "Memory budget of the search tree in MB, least recently used nodes are evicted above it (0 for no limit)",
+            false, settings.treeMemoryMB, "integer", cmd);
+        
+
+    	ValueArg<int> nThreadsArg("t", "threads",
+            "Number of threads of the work-stealing scheduler, shared by all the parallel searches",
+            false, settings.nThreads, "integer", cmd);
+        
+    	ValueArg<int> jobsArg("j", "jobs",
+            "Number of files solved at the same time",
+            false, jobs, "integer", cmd);
+        
+    	ValueArg<int> prefetchArg("", "prefetch",
+            "Number of files parsed in advance by a background thread (0 to parse each file before solving it)",
+            false, prefetch, "integer", cmd);
+        
+    	SwitchArg portfolioSwitch("", "portfolio",
+            "Run variants of the settings (method, flip algorithm, heuristics, eps), one per thread, sharing the best assignment",
+            cmd, false);
+        
+    	ValueArg<int> targetArg("", "target",
+            "Stop the search once an assignment with at most this number of unverified clauses is found",
+            false, settings.target, "integer", cmd);
+        
+    	ValueArg<string> parallelArg("", "parallel",
+            "Parallel MCTS mode (root for one tree per thread, merging the root statistics, tree for a shared tree)",
+            false, parallelModes[(int)settings.parallel], &parallelModesConstraint, cmd);
+        
+    	ValueArg<int> virtualLossArg("", "vloss",
+            "Virtual loss added to an action while a thread goes through it (tree parallel MCTS)",
+            false, settings.virtualLoss, "integer", cmd);
+        
+    	ValueArg<int> leafRolloutsArg("", "leaf_k",
+            "Number of rollouts evaluated in parallel each time a node is rolled out",
+            false, settings.leafRollouts, "integer", cmd);
+        
+    	ValueArg<string> leafReduceArg("", "leaf_reduce",
+            "How the parallel rollouts of a node are combined",
+            false, leafReduces[(int)settings.leafReduce], &leafReducesConstraint, cmd);
+        
+    	ValueArg<int> parallelDepthArg("", "par_depth",
+            "Number of top levels of Sequential Halving and NMCS whose moves are evaluated in parallel",
+            false, settings.parallelDepth, "integer", cmd);
+        
+    	ValueArg<int> syncStepsArg("", "sync",
+            "Number of steps between merges of the parallel searches (0 to only merge before a decision)",
+            false, settings.syncSteps, "integer", cmd);
+        
 
         // Parse the CMD arguments
 	    cmd.parse(argc, argv);
@@ -158,21 +322,42 @@ int main(int argc, char** argv) {
 
         settings.rolloutHeuristic = rolloutHeuristicArg.getValue();
         settings.dynamicHeuristic = dynamicHeuristicSwitch.getValue();
-        settings.flipAlgorithm = flipAlgorithmArg.getValue();
+        settings.rolloutPropagation = rolloutPropagationSwitch.getValue();
+        settings.rolloutCache = rolloutCacheArg.getValue();
+        settings.phasePool = phasePoolArg.getValue();
+        settings.phaseEps = phaseEpsArg.getValue();
+        settings.flipAlgorithm = FlipAlgorithm(
+            find(begin(flipAlgorithms), end(flipAlgorithms), flipAlgorithmArg.getValue()) - begin(flipAlgorithms));
         settings.walkBudgetPerVar = walkBudgetPerVarArg.getValue();
         settings.walkEps = walkEpsArg.getValue();
         settings.amaf = amafArg.getValue();
         settings.amafBias = amafBiasArg.getValue();
 
         settings.ucbCExplo = ucbCExploArg.getValue();
-        settings.behavior = behaviorArg.getValue();
+        settings.behavior = Behavior(find(begin(behaviors), end(behaviors), behaviorArg.getValue()) - begin(behaviors));
         settings.steps = stepsArg.getValue();
         settings.nmcsDepth = nmcsDepthArg.getValue();
+        settings.treeMemoryMB = treeMemoryArg.getValue();
+        settings.nThreads = nThreadsArg.getValue();
+        settings.parallel = ParallelMode(
+            find(begin(parallelModes), end(parallelModes), parallelArg.getValue()) - begin(parallelModes));
+        settings.syncSteps = syncStepsArg.getValue();
+        settings.virtualLoss = virtualLossArg.getValue();
+        settings.leafRollouts = leafRolloutsArg.getValue();
+        settings.leafReduce = LeafReduce(
+            find(begin(leafReduces), end(leafReduces), leafReduceArg.getValue()) - begin(leafReduces));
+        settings.parallelDepth = parallelDepthArg.getValue();
+        settings.target = targetArg.getValue();
+        portfolio = portfolioSwitch.getValue();
+        jobs = jobsArg.getValue();
+        prefetch = prefetchArg.getValue();
 
 	} catch (ArgException &e) {
         cerr << "error: " << e.error() << " for arg " << e.argId() << endl;
         return -1;
     }
+    int nJobs = max(1, jobs);
+    setNumThreads(max(settings.nThreads, nJobs)); // Jobs and their searches share the scheduler
 
     vector<string> dataFiles;
     for (const auto& dataFile : fs::directory_iterator(dataPath)) {
@@ -186,39 +371,90 @@ int main(int argc, char** argv) {
     double totalScore = 0;
     double totalTime = 0;
 
-    for (int iFile = 0; iFile < (int)dataFiles.size(); iFile++) {
-        cout << "Running " << method << " on file " << (iFile+1) << "/" << dataFiles.size()
-            << " [" << dataFiles[iFile] << "]" << endl;
+    // Results are printed in the order of the files, as soon as all the previous files are solved
+    vector<FileResult> results(dataFiles.size());
+    int nbPrinted = 0;
+    mutex printLock;
 
-        // Initialize the problem
-        srand(settings.seed);
-        SatProblem problem = readSatProblem(dataFiles[iFile]);
+    auto solveFile = [&](int iFile, const SatProblem& problem) {
+        {
+            lock_guard<mutex> guard(printLock);
+            cout << "Running " << method << " on file " << (iFile+1) << "/" << dataFiles.size()
+                << " [" << dataFiles[iFile] << "]" << endl;
+        }
+
+        // Initialize the instance, with the same random stream whatever the job running it
+        seedRandom(settings.seed);
         MCTSInstance<> inst{settings, problem};
 
         auto startClock = chrono::high_resolution_clock::now();
-        if (method == "rollout") {
-            runRollout(inst);
-        } else if (method == "mcts") {
-            runMCTS(inst);
-        } else if (method == "nested_mc") {
-            runNMCS(inst);
-        } else if (method == "seq_halving") {
-            runSeqHalving(inst);
+        if (portfolio) {
+            runPortfolio(inst, method);
+        } else {
+            runMethod(inst, method);
         }
         auto stopClock = chrono::high_resolution_clock::now();
         auto runDuration = duration_cast<chrono::milliseconds>(stopClock - startClock);
-        double runTime = runDuration.count() / 1000.0;
-
-        totalScore += inst.minUnverified;
-        totalTime += runTime;
-        cout << "score=" << inst.minUnverified
-            << "  (avg=" << C_GREEN << setprecision(6) << (totalScore / (iFile+1)) << C_RESET
-            << ", avg_time=" << C_CYAN << setprecision(3) << (totalTime / (iFile+1)) << "s" << C_RESET
-            << ")" << endl;
+
+        lock_guard<mutex> guard(printLock);
+        results[iFile] = {true, inst.best.score, runDuration.count() / 1000.0, inst.tree.size(),
+            inst.treeBytes, inst.peakTreeBytes, inst.nbEvicted, inst.nbReleased, inst.nbConflicts, false, false, 0};
+        if (settings.usesMarginals()) {
+            const Marginals& marginals = problem.marginals();
+            results[iFile].marginalsSurvey = marginals.survey;
+            results[iFile].marginalsConverged = marginals.converged;
+            results[iFile].marginalsIterations = marginals.nbIterations;
+        }
+        for (; nbPrinted < (int)results.size() && results[nbPrinted].done; nbPrinted++) {
+            const FileResult& result = results[nbPrinted];
+            totalScore += result.score;
+            totalTime += result.time;
+            if (nJobs > 1) {
+                cout << "[" << dataFiles[nbPrinted] << "] ";
+            }
+            cout << "score=" << result.score
+                << "  (avg=" << C_GREEN << setprecision(6) << (totalScore / (nbPrinted+1)) << C_RESET
+                << ", avg_time=" << C_CYAN << setprecision(3) << (totalTime / (nbPrinted+1)) << "s" << C_RESET
+                << ")" << endl;
+            cout << "tree: " << result.treeNodes << " nodes, "
+                << setprecision(4) << (result.treeBytes / 1048576.) << "MB (peak " << (result.peakTreeBytes / 1048576.) << "MB)"
+                << ", " << result.nbEvicted << " evicted, " << result.nbReleased << " released on commits" << endl;
+            if (settings.rolloutPropagation) {
+                cout << "propagation: " << result.nbConflicts << " conflicts in the rollouts" << endl;
+            }
+            if (settings.usesMarginals()) {
+                cout << "marginals: " << (result.marginalsSurvey ? "survey" : "belief") << " propagation, "
+                    << (result.marginalsConverged ? "converged" : "stopped") << " after "
+                    << result.marginalsIterations << " iterations" << endl;
+            }
+        }
+    };
+
+    auto startWall = chrono::high_resolution_clock::now();
+    clock_t startCpu = clock();
+    {
+        ProblemLoader loader(dataFiles, prefetch);
+        auto runJob = [&]() { // Take the next file when done
+            int iFile;
+            unique_ptr<SatProblem> problem;
+            while (loader.next(iFile, problem)) {
+                solveFile(iFile, *problem);
+            }
+        };
+        if (nJobs > 1) {
+            parallelFor(min(nJobs, (int)dataFiles.size()), [&](int) { runJob(); });
+        } else {
+            runJob();
+        }
     }
+    double wallTime = duration_cast<chrono::milliseconds>(chrono::high_resolution_clock::now() - startWall).count() / 1000.0;
+    double cpuTime = (clock() - startCpu) / (double)CLOCKS_PER_SEC; // Summed over all the threads
+
     cout << "Final average score is " << C_GREEN << setprecision(6) << (totalScore / dataFiles.size()) << C_RESET
         << "    (avg_time=" << C_CYAN << setprecision(3) << (totalTime / dataFiles.size()) << "s" << C_RESET
         << ", total_time=" << C_CYAN << ((int)totalTime) << "s" << C_RESET
+        << ", wall_time=" << C_CYAN << wallTime << "s" << C_RESET
+        << ", cpu_time=" << C_CYAN << cpuTime << "s" << C_RESET
         << ")" << endl;
     
 }
\ No newline at end of file
@@ -0,0 +1,233 @@
+#include <cstdlib>
+#include <algorithm>
+#include <vector>
+#include <array>
+#include <numeric>
+#include <cmath>
+#include <random>
+#include <mutex>
+#include <optional>
+#include <tuple>
+
+#include "marginals.hpp"
+#include "scheduler.hpp"
+
+using namespace std;
+
+const int MAX_ITERATIONS = 1000;
+const double CONVERGENCE_EPS = 1e-3; // Largest change of a message between two iterations
+const double TRIVIAL_EPS = 1e-2; // Surveys all below it are the trivial fixed point
+const double DAMPING = 0.5; // Part of the old message kept, synchronous updates oscillate without it
+const double ZERO_EPS = 1e-16;
+const int BLOCK_SIZE = 256; // Variables or clauses updated by each task
+
+/*
+    Factor graph
+*/
+
+// The edges are stored clause by clause, so that the clause updates read and write contiguous messages
+struct FactorGraph {
+    vector<int> clauseStart; // Edges of the clause iCls are in [clauseStart[iCls], clauseStart[iCls+1])
+    vector<int> edgeVar;
+    vector<char> edgeIsTrue;
+    vector<int> varStart; // Edges of the variable iVar are varEdges[varStart[iVar]], ..., varEdges[varStart[iVar+1]-1]
+    vector<int> varEdges;
+
+    FactorGraph(const SatProblem& pb) {
+        clauseStart = vector<int>(pb.nClauses+1, 0);
+        varStart = vector<int>(pb.nVars+1, 0);
+        for (int iCls = 0; iCls < pb.nClauses; iCls++) {
+            clauseStart[iCls+1] = clauseStart[iCls] + pb.clauses[iCls].size();
+            for (const Literal& lit : pb.clauses[iCls]) {
+                edgeVar.push_back(lit.varId);
+                edgeIsTrue.push_back(lit.isTrue);
+                varStart[lit.varId+1]++;
+            }
+        }
+        partial_sum(begin(varStart), end(varStart), begin(varStart));
+        varEdges = vector<int>(edgeVar.size());
+        vector<int> nbPlaced(pb.nVars, 0);
+        for (int iEdge = 0; iEdge < (int)edgeVar.size(); iEdge++) {
+            int iVar = edgeVar[iEdge];
+            varEdges[varStart[iVar] + nbPlaced[iVar]++] = iEdge;
+        }
+    }
+};
+
+/*
+    Message passing
+*/
+
+// Messages of the edges, from the clauses to the variables: probability that the clause forces the variable
+// to satisfy it (survey), or that only this variable can satisfy it (belief)
+struct MessagePassing {
+    const FactorGraph& graph;
+    bool survey;
+    vector<double> eta;
+    vector<array<double, 2>> prodNonZero; // Product of the (1 - eta) of the edges of each literal, without the zeros
+    vector<array<int, 2>> nbZeros; // Number of zero factors left out of prodNonZero
+
+    MessagePassing(const FactorGraph& _graph, bool _survey) : graph(_graph), survey(_survey) {
+        int nVars = graph.varStart.size() - 1;
+        mt19937 generator(0); // Same messages for each run
+        uniform_real_distribution<double> initDistribution(0, 1);
+        eta = vector<double>(graph.edgeVar.size());
+        for (double& message : eta) {
+            message = initDistribution(generator);
+        }
+        prodNonZero = vector<array<double, 2>>(nVars);
+        nbZeros = vector<array<int, 2>>(nVars);
+    }
+
+    void updateProducts(int iVar) {
+        prodNonZero[iVar] = {1, 1};
+        nbZeros[iVar] = {0, 0};
+        for (int iPos = graph.varStart[iVar]; iPos < graph.varStart[iVar+1]; iPos++) {
+            int iEdge = graph.varEdges[iPos];
+            double factor = 1 - eta[iEdge];
+            if (factor < ZERO_EPS) {
+                nbZeros[iVar][graph.edgeIsTrue[iEdge]]++;
+            } else {
+                prodNonZero[iVar][graph.edgeIsTrue[iEdge]] *= factor;
+            }
+        }
+    }
+
+    double product(int iVar, bool isTrue) const { // Over all the clauses using the literal
+        return nbZeros[iVar][isTrue] ? 0 : prodNonZero[iVar][isTrue];
+    }
+
+    double edgeRatio(int iEdge) const {
+        /* Probability that the variable of the edge does not satisfy the clause, from the other clauses */
+        int iVar = graph.edgeVar[iEdge];
+        bool isTrue = graph.edgeIsTrue[iEdge];
+        double factor = 1 - eta[iEdge];
+        double same, opposite = product(iVar, !isTrue); // Clauses other than the one of the edge
+        if (factor < ZERO_EPS) {
+            same = (nbZeros[iVar][isTrue] > 1) ? 0 : prodNonZero[iVar][isTrue];
+        } else {
+            same = nbZeros[iVar][isTrue] ? 0 : prodNonZero[iVar][isTrue] / factor;
+        }
+
+        if (survey) {
+            double unsatisfying = (1 - opposite) * same;
+            double total = unsatisfying + (1 - same) * opposite + same * opposite;
+            return (total > ZERO_EPS) ? unsatisfying / total : 0;
+        }
+        double total = same + opposite;
+        return (total > ZERO_EPS) ? same / total : 0.5;
+    }
+
+    double updateClause(int iCls, vector<double>& ratios) {
+        /* Returns the largest change of the messages of the clause */
+        int first = graph.clauseStart[iCls], last = graph.clauseStart[iCls+1];
+        double prodRatios = 1, maxDelta = 0;
+        int nbZeroRatios = 0;
+        ratios.resize(last - first);
+        for (int iEdge = first; iEdge < last; iEdge++) {
+            ratios[iEdge - first] = edgeRatio(iEdge);
+            if (ratios[iEdge - first] < ZERO_EPS) {
+                nbZeroRatios++;
+            } else {
+                prodRatios *= ratios[iEdge - first];
+            }
+        }
+        for (int iEdge = first; iEdge < last; iEdge++) { // Product of the ratios of the other variables
+            double ratio = ratios[iEdge - first], message;
+            if (ratio < ZERO_EPS) {
+                message = (nbZeroRatios > 1) ? 0 : prodRatios;
+            } else {
+                message = nbZeroRatios ? 0 : prodRatios / ratio;
+            }
+            message = DAMPING * eta[iEdge] + (1 - DAMPING) * message;
+            maxDelta = max(maxDelta, abs(message - eta[iEdge]));
+            eta[iEdge] = message;
+        }
+        return maxDelta;
+    }
+
+    pair<bool, int> run() {
+        /* Synchronous updates: the products of all the variables, then the messages of all the clauses.
+        Each task owns a block of variables or of clauses, so the result does not depend on the threads. */
+        int nVars = graph.varStart.size() - 1, nClauses = graph.clauseStart.size() - 1;
+        int nVarBlocks = (nVars + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        int nClauseBlocks = (nClauses + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        vector<double> blockDelta(nClauseBlocks);
+        if (!nClauses) {
+            return {true, 0};
+        }
+
+        for (int iIteration = 1; iIteration <= MAX_ITERATIONS; iIteration++) {
+            parallelFor(nVarBlocks, [&](int iBlock) {
+                for (int iVar = iBlock * BLOCK_SIZE; iVar < min(nVars, (iBlock+1) * BLOCK_SIZE); iVar++) {
+                    updateProducts(iVar);
+                }
+            });
+            parallelFor(nClauseBlocks, [&](int iBlock) {
+                vector<double> ratios;
+                blockDelta[iBlock] = 0;
+                for (int iCls = iBlock * BLOCK_SIZE; iCls < min(nClauses, (iBlock+1) * BLOCK_SIZE); iCls++) {
+                    blockDelta[iBlock] = max(blockDelta[iBlock], updateClause(iCls, ratios));
+                }
+            });
+            if (*max_element(begin(blockDelta), end(blockDelta)) < CONVERGENCE_EPS) {
+                return {true, iIteration};
+            }
+        }
+        return {false, MAX_ITERATIONS};
+    }
+
+    bool isTrivial() const {
+        return all_of(begin(eta), end(eta), [](double message) { return message < TRIVIAL_EPS; });
+    }
+};
+
+Marginals computeMarginals(const SatProblem& pb) {
+    FactorGraph graph(pb);
+    Marginals marginals;
+    marginals.survey = true;
+    MessagePassing surveys(graph, true);
+    optional<MessagePassing> beliefs;
+    tie(marginals.converged, marginals.nbIterations) = surveys.run();
+    if (pb.nClauses && (!marginals.converged || surveys.isTrivial())) {
+        marginals.survey = false;
+        beliefs.emplace(graph, false);
+        tie(marginals.converged, marginals.nbIterations) = beliefs->run();
+    }
+    MessagePassing& messages = beliefs ? *beliefs : surveys;
+
+    marginals.biasTrue = vector<double>(pb.nVars, 0);
+    marginals.biasFalse = vector<double>(pb.nVars, 0);
+    marginals.polarity = Assignment(pb.nVars);
+    for (int iVar = 0; iVar < pb.nVars; iVar++) {
+        messages.updateProducts(iVar);
+        double prodTrue = messages.product(iVar, true), prodFalse = messages.product(iVar, false);
+        double weightTrue, weightFalse, total;
+        if (marginals.survey) { // Forced by a clause of one literal, and by none of the other
+            weightTrue = (1 - prodTrue) * prodFalse;
+            weightFalse = (1 - prodFalse) * prodTrue;
+            total = weightTrue + weightFalse + prodTrue * prodFalse;
+        } else { // The clauses of the other literal are satisfied by the other variables
+            weightTrue = prodFalse;
+            weightFalse = prodTrue;
+            total = weightTrue + weightFalse;
+        }
+        if (total > ZERO_EPS) {
+            marginals.biasTrue[iVar] = weightTrue / total;
+            marginals.biasFalse[iVar] = weightFalse / total;
+        }
+        marginals.polarity[iVar] = (marginals.biasTrue[iVar] >= marginals.biasFalse[iVar]);
+    }
+
+    marginals.varsByBias = vector<int>(pb.nVars);
+    iota(begin(marginals.varsByBias), end(marginals.varsByBias), 0);
+    stable_sort(begin(marginals.varsByBias), end(marginals.varsByBias), [&](int i1, int i2) {
+        return abs(marginals.biasTrue[i1] - marginals.biasFalse[i1]) > abs(marginals.biasTrue[i2] - marginals.biasFalse[i2]);
+    });
+    return marginals;
+}
+
+const Marginals& SatProblem::marginals() const {
+    call_once(marginalsCache->computed, [&]() { marginalsCache->marginals = computeMarginals(*this); });
+    return marginalsCache->marginals;
+}
@@ -0,0 +1,32 @@
+#ifndef MARGINALS_HPP
+#define MARGINALS_HPP
+
+#include <vector>
+#include <mutex>
+
+#include "maxsat.hpp"
+
+/*
+    Message passing over the factor graph of the clauses.
+    Survey propagation gives the probability of each variable to be forced to a value. When the surveys vanish
+    (trivial fixed point) or do not converge, belief propagation is used instead.
+*/
+
+struct Marginals {
+    std::vector<double> biasTrue, biasFalse; // Weight of each value of the variables
+    Assignment polarity; // Value with the largest weight (true if tied)
+    std::vector<int> varsByBias; // Decreasing |biasTrue - biasFalse|, then by id
+    bool survey; // Computed by survey propagation, else by belief propagation
+    bool converged;
+    int nbIterations;
+};
+
+// Marginals of a problem, computed on the first use
+struct MarginalsCache {
+    std::once_flag computed;
+    Marginals marginals;
+};
+
+Marginals computeMarginals(const SatProblem&);
+
+#endif
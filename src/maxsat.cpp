@@ -4,11 +4,11 @@
 #include <array>
 #include <numeric>
 #include <string>
-#include <queue>
 #include <iostream>
 #include <tuple>
 
 #include "maxsat.hpp"
+#include "marginals.hpp"
 #include "util.hpp"
 
 using namespace std;
@@ -41,6 +41,23 @@ SatProblem::SatProblem(vector<Clause>& initClauses, int initNVars) {
             clausesUsingLit[lit.varId][lit.isTrue].push_back(iCls);
         }
     }
+
+    nbTimesAsLit = vector<array<int, 2>>(nVars, {0, 0});
+    staticPolarity = Assignment(nVars);
+    for (int iVar = 0; iVar < nVars; iVar++) {
+        nbTimesAsLit[iVar] = {(int)clausesUsingLit[iVar][0].size(), (int)clausesUsingLit[iVar][1].size()};
+        staticPolarity[iVar] = (nbTimesAsLit[iVar][1] >= nbTimesAsLit[iVar][0]);
+    }
+    varsByOccurrences = vector<int>(nVars);
+    iota(begin(varsByOccurrences), end(varsByOccurrences), 0);
+    varsByMaxLiteral = varsByOccurrences;
+    stable_sort(begin(varsByOccurrences), end(varsByOccurrences), [&](int i1, int i2) {
+        return nbTimesAsLit[i1][0] + nbTimesAsLit[i1][1] > nbTimesAsLit[i2][0] + nbTimesAsLit[i2][1];
+    });
+    stable_sort(begin(varsByMaxLiteral), end(varsByMaxLiteral), [&](int i1, int i2) {
+        return max(nbTimesAsLit[i1][0], nbTimesAsLit[i1][1]) > max(nbTimesAsLit[i2][0], nbTimesAsLit[i2][1]);
+    });
+    marginalsCache = make_shared<MarginalsCache>();
 }
 
 Assignment SatProblem::freeAssignment() const {
@@ -48,9 +65,7 @@ Assignment SatProblem::freeAssignment() const {
 }
 
 Assignment SatProblem::randomAssignment() const {
-    auto assign = this->freeAssignment();
-    assignAtRandom(*this, assign);
-    return assign;
+    return assignAtRandom(*this, this->freeAssignment());
 }
 
 vector<int> SatProblem::unverifiedClauses(const Assignment& assign) const {
@@ -70,6 +85,18 @@ vector<int> SatProblem::unverifiedClauses(const Assignment& assign) const {
     return unverified;
 }
 
+vector<int> SatProblem::nbTrueByClause(const Assignment& assign) const {
+    vector<int> nbTrue(this->nClauses, 0);
+    for (int iCls = 0; iCls < this->nClauses; iCls++) {
+        for (const Literal& lit : this->clauses[iCls]) {
+            if (assign[lit.varId] == lit.isTrue) {
+                nbTrue[iCls] += 1;
+            }
+        }
+    }
+    return nbTrue;
+}
+
 int SatProblem::score(const Assignment& assign) const {
     return this->unverifiedClauses(assign).size();
 }
@@ -83,114 +110,155 @@ Assignment assignAtRandom(const SatProblem& pb, const Assignment& prevAssign) {
     auto assign = prevAssign;
     for (int iVar = 0; iVar < pb.nVars; iVar++) {
         if (assign[iVar] == UNASSIGNED) {
-            assign[iVar] = rand()%2;
+            assign[iVar] = randInt()%2;
         }
     }
     return assign;
 }
 
-Assignment assignStatic(const SatProblem& pb, const Assignment& prevAssign, string sortOrder) {
+Assignment assignStatic(const SatProblem& pb, const Assignment& prevAssign) {
+    /* Each variable takes its most frequent literal, so the order of the static heuristics doesn't change the result */
     auto assign = prevAssign;
-    vector<array<int, 2>> nbTimesAs(pb.nVars, {0, 0});
-    vector<int> varOrder(pb.nVars);
-    iota(begin(varOrder), end(varOrder), 0);
-
-    for (const Clause& cls : pb.clauses) {
-        for (const Literal& lit : cls) {
-            nbTimesAs[lit.varId][lit.isTrue]++;
-        }
-    }
-    if (sortOrder == "max_literal") {
-        sort(varOrder.begin(), varOrder.end(), [&nbTimesAs](int i1, int i2) -> bool { 
-            return max(nbTimesAs[i1][0], nbTimesAs[i1][1]) > max(nbTimesAs[i2][0], nbTimesAs[i2][1]); 
-        });
-    } else if (sortOrder == "max_var") {
-        sort(varOrder.begin(), varOrder.end(), [&nbTimesAs](int i1, int i2) -> bool { 
-            return nbTimesAs[i1][0] + nbTimesAs[i1][1] > nbTimesAs[i2][0] + nbTimesAs[i2][1]; 
-        });
-    }
-    // reverse(varOrder.begin(), varOrder.end());
-    for (int iVar : varOrder) {
+    for (int iVar = 0; iVar < pb.nVars; iVar++) {
         if (assign[iVar] == UNASSIGNED) {
-            assign[iVar] = (nbTimesAs[iVar][1] >= nbTimesAs[iVar][0]);
+            assign[iVar] = pb.staticPolarity[iVar];
         }
     }
     return assign;
 }
 
 Assignment assignInOrderH1Static(const SatProblem& pb, const Assignment& assign) {
-    return assignStatic(pb, assign, "None");
+    return assignStatic(pb, assign);
 }
 
 Assignment assignMostFrequentVarH2Static(const SatProblem& pb, const Assignment& assign) {
-    return assignStatic(pb, assign, "max_var");
+    return assignStatic(pb, assign);
 }
 
 Assignment assignMostFrequentLitH3Static(const SatProblem& pb, const Assignment& assign) {
-    return assignStatic(pb, assign, "max_literal");
+    return assignStatic(pb, assign);
 }
 
-Assignment assignDynamic(const SatProblem& pb, const Assignment& prevAssign, bool scoreIsId, bool scoreByLiteral) {
+Assignment assignWithPolarity(const SatProblem& pb, const Assignment& prevAssign, const Assignment& polarity) {
     auto assign = prevAssign;
-    vector<array<int, 2>> nbOccLit(pb.nVars, {0, 0});
-    vector<vector<int>> clausesUsingVar(pb.nVars);
-    vector<bool> isClauseVerified(pb.nClauses, false);
-
-    // Init
-    for (int iCls = 0; iCls < (int)pb.nClauses; iCls++) {
-        for (const Literal& lit : pb.clauses[iCls]) {
-            nbOccLit[lit.varId][lit.isTrue] += 1;
-            clausesUsingVar[lit.varId].push_back(iCls);
-        }
-    }
-    // Compute initial score for variables
-    vector<int> varScore(pb.nVars, 0);
-    priority_queue<pair<int, int>> scoresWithVars; // (score, varId);
     for (int iVar = 0; iVar < pb.nVars; iVar++) {
         if (assign[iVar] == UNASSIGNED) {
-            varScore[iVar] = scoreIsId ? (-iVar) : (
-                scoreByLiteral ? max(nbOccLit[iVar][0], nbOccLit[iVar][1]) :
-                    (nbOccLit[iVar][0] + nbOccLit[iVar][1])
-            );
-        } else {
-            varScore[iVar] = pb.nClauses * 10; // Large score to ensure they will be first
+            assign[iVar] = polarity[iVar];
         }
-        scoresWithVars.push({varScore[iVar], iVar});
     }
+    return assign;
+}
 
-    // Loop over variables in the order of their score
-    while (!scoresWithVars.empty()) {
-        int score = scoresWithVars.top().first;
-        int iVar = scoresWithVars.top().second;
-        scoresWithVars.pop();
+Assignment assignMarginals(const SatProblem& pb, const Assignment& assign) {
+    return assignWithPolarity(pb, assign, pb.marginals().polarity);
+}
 
-        if (score == varScore[iVar]) { // Check if no update in between
-            // Assign the variable
-            if (assign[iVar] == UNASSIGNED) {
-                assign[iVar] = (nbOccLit[iVar][1] >= nbOccLit[iVar][0]);
+// Buffers of the dynamic heuristics, kept by each thread from one call to the next
+struct DynamicWorkspace {
+    vector<array<int, 2>> nbOccLit; // Occurrences of each literal in the clauses left
+    vector<char> isClauseVerified;
+    vector<int> varScore;
+    vector<int> bucketHead, nextInBucket, prevInBucket; // Unassigned variables by score, -1 at the ends
+};
+
+thread_local DynamicWorkspace dynamicWorkspace;
+
+Assignment assignDynamic(const SatProblem& pb, const Assignment& prevAssign, bool scoreIsId, bool scoreByLiteral) {
+    /* Greedy assignment of the variables by decreasing score, the scores only counting the clauses
+    which don't use an assigned variable yet. Scores are small integers that only decrease,
+    so the variables are kept in buckets by score. */
+    auto assign = prevAssign;
+    auto& [nbOccLit, isClauseVerified, varScore, bucketHead, nextInBucket, prevInBucket] = dynamicWorkspace;
+    nbOccLit.assign(begin(pb.nbTimesAsLit), end(pb.nbTimesAsLit));
+    isClauseVerified.assign(pb.nClauses, false);
+    varScore.resize(pb.nVars);
+    nextInBucket.resize(pb.nVars);
+    prevInBucket.resize(pb.nVars);
+
+    auto scoreOf = [&](int iVar) {
+        return scoreByLiteral ? max(nbOccLit[iVar][0], nbOccLit[iVar][1]) : (nbOccLit[iVar][0] + nbOccLit[iVar][1]);
+    };
+    auto unlink = [&](int iVar) {
+        if (prevInBucket[iVar] >= 0) {
+            nextInBucket[prevInBucket[iVar]] = nextInBucket[iVar];
+        } else {
+            bucketHead[varScore[iVar]] = nextInBucket[iVar];
+        }
+        if (nextInBucket[iVar] >= 0) {
+            prevInBucket[nextInBucket[iVar]] = prevInBucket[iVar];
+        }
+    };
+    auto pushFront = [&](int iVar) {
+        prevInBucket[iVar] = -1;
+        nextInBucket[iVar] = bucketHead[varScore[iVar]];
+        if (nextInBucket[iVar] >= 0) {
+            prevInBucket[nextInBucket[iVar]] = iVar;
+        }
+        bucketHead[varScore[iVar]] = iVar;
+    };
+    auto removeClausesUsing = [&](int iVar, bool updateScores) {
+        for (int iCls : pb.clausesUsingVar[iVar]) {
+            if (isClauseVerified[iCls]) {
+                continue;
             }
-            // Remove newly verified clauses using this literal
-            for (int iCls : clausesUsingVar[iVar]) {
-                if (!isClauseVerified[iCls]) {
-                    isClauseVerified[iCls] = true;
-                    // Update literals that are in this clause
-                    for (const Literal& lit : pb.clauses[iCls]) {
-                        nbOccLit[lit.varId][lit.isTrue] -= 1;
-                        if (assign[lit.varId] == UNASSIGNED && !scoreIsId) {
-                            // If the score changed for the lit variable, update it
-                            int nextVarScore = scoreByLiteral ?
-                                max(nbOccLit[lit.varId][0], nbOccLit[lit.varId][1])
-                                : (nbOccLit[lit.varId][0] + nbOccLit[lit.varId][1])
-                            ;
-                            if (nextVarScore < varScore[lit.varId]) {
-                                varScore[lit.varId] = nextVarScore;
-                                scoresWithVars.push({nextVarScore, lit.varId});
-                            }
-                        }
-                    }
+            isClauseVerified[iCls] = true;
+            for (const Literal& lit : pb.clauses[iCls]) {
+                nbOccLit[lit.varId][lit.isTrue] -= 1;
+                if (updateScores && assign[lit.varId] == UNASSIGNED && scoreOf(lit.varId) < varScore[lit.varId]) {
+                    unlink(lit.varId); // Move the variable to its new bucket
+                    varScore[lit.varId] = scoreOf(lit.varId);
+                    pushFront(lit.varId);
                 }
             }
         }
+    };
+    auto assignVar = [&](int iVar) {
+        assign[iVar] = (nbOccLit[iVar][1] >= nbOccLit[iVar][0]);
+    };
+
+    // Variables already assigned come first
+    for (int iVar = pb.nVars-1; iVar >= 0; iVar--) {
+        if (assign[iVar] != UNASSIGNED) {
+            removeClausesUsing(iVar, false);
+        }
+    }
+    if (scoreIsId) { // H1: the order doesn't change
+        for (int iVar = 0; iVar < pb.nVars; iVar++) {
+            if (assign[iVar] == UNASSIGNED) {
+                assignVar(iVar);
+                removeClausesUsing(iVar, false);
+            }
+        }
+        return assign;
+    }
+
+    // Fill the buckets, the largest ids first in each bucket
+    int topScore = 0;
+    for (int iVar = 0; iVar < pb.nVars; iVar++) {
+        if (assign[iVar] == UNASSIGNED) {
+            varScore[iVar] = scoreOf(iVar);
+            topScore = max(topScore, varScore[iVar]);
+        }
+    }
+    bucketHead.assign(topScore + 1, -1);
+    for (int iVar = 0; iVar < pb.nVars; iVar++) {
+        if (assign[iVar] == UNASSIGNED) {
+            pushFront(iVar);
+        }
+    }
+
+    // Loop over variables in the order of their score
+    while (true) {
+        while (topScore >= 0 && bucketHead[topScore] < 0) {
+            topScore--;
+        }
+        if (topScore < 0) {
+            break;
+        }
+        int iVar = bucketHead[topScore];
+        unlink(iVar);
+        assignVar(iVar);
+        removeClausesUsing(iVar, true);
     }
     return assign;
 }
@@ -208,20 +276,155 @@ Assignment assignMostFrequentLitH3Dynamic(const SatProblem& pb, const Assignment
 }
 
 
+// Two watched literals of each clause, kept by each thread from one rollout to the next
+struct PropagationWorkspace {
+    vector<array<int, 2>> watchedPos; // Positions in the clause of its two watched literals
+    vector<vector<int>> watches; // Clauses watching each literal id
+    vector<char> isConflict;
+    vector<Literal> trail;
+};
+
+thread_local PropagationWorkspace propagationWorkspace;
+
+Assignment assignWithPropagation(const SatProblem& pb, const Assignment& prevAssign, const vector<int>* order,
+        const Assignment* polarity, long long& nbConflicts) {
+    /* The watches are chosen again from the assignment received, as it changes at each rollout:
+    non false literals are watched first, so that a clause is only visited when a watched literal becomes false */
+    auto assign = prevAssign;
+    auto& [watchedPos, watches, isConflict, trail] = propagationWorkspace;
+    watchedPos.resize(pb.nClauses);
+    watches.resize(2 * pb.nVars);
+    for (vector<int>& watchList : watches) {
+        watchList.clear();
+    }
+    isConflict.assign(pb.nClauses, false);
+    trail.clear();
+
+    auto isFalse = [&](const Literal& lit) { return assign[lit.varId] != UNASSIGNED && assign[lit.varId] != lit.isTrue; };
+    auto setTrue = [&](const Literal& lit) {
+        assign[lit.varId] = lit.isTrue;
+        trail.push_back(lit);
+    };
+    auto conflict = [&](int iCls) {
+        if (!isConflict[iCls]) {
+            isConflict[iCls] = true;
+            nbConflicts++;
+        }
+    };
+
+    // Watch two literals of each clause, and find the clauses which are already unit or false
+    for (int iCls = 0; iCls < pb.nClauses; iCls++) {
+        const Clause& cls = pb.clauses[iCls];
+        if (cls.empty()) {
+            continue;
+        }
+        array<int, 2> pos = {0, min(1, (int)cls.size() - 1)};
+        int nbNonFalse = 0;
+        for (int iLit = 0; iLit < (int)cls.size() && nbNonFalse < 2; iLit++) {
+            if (!isFalse(cls[iLit])) {
+                pos[nbNonFalse++] = iLit;
+            }
+        }
+        if (nbNonFalse == 1 && pos[1] == pos[0]) {
+            pos[1] = (pos[0] == 0) ? min(1, (int)cls.size() - 1) : 0;
+        }
+        watchedPos[iCls] = pos;
+        watches[cls[pos[0]].id(pb)].push_back(iCls);
+        if (pos[1] != pos[0]) {
+            watches[cls[pos[1]].id(pb)].push_back(iCls);
+        }
+        if (nbNonFalse == 0) {
+            conflict(iCls);
+        } else if (nbNonFalse == 1 && assign[cls[pos[0]].varId] == UNASSIGNED) {
+            setTrue(cls[pos[0]]);
+        }
+    }
+
+    // Visit the clauses watching the literals which became false
+    size_t nbPropagated = 0;
+    auto propagate = [&]() {
+        for (; nbPropagated < trail.size(); nbPropagated++) {
+            Literal falseLit{trail[nbPropagated].varId, !trail[nbPropagated].isTrue};
+            vector<int>& watchList = watches[falseLit.id(pb)];
+            int nbKept = 0;
+            for (int iWatch = 0; iWatch < (int)watchList.size(); iWatch++) {
+                int iCls = watchList[iWatch];
+                const Clause& cls = pb.clauses[iCls];
+                array<int, 2>& pos = watchedPos[iCls];
+                if (cls[pos[0]] == falseLit) {
+                    swap(pos[0], pos[1]);
+                }
+                const Literal& other = cls[pos[0]];
+                if (pos[0] == pos[1] || assign[other.varId] == other.isTrue) {
+                    watchList[nbKept++] = iCls;
+                    continue;
+                }
+                bool moved = false;
+                for (int iLit = 0; iLit < (int)cls.size() && !moved; iLit++) {
+                    if (iLit != pos[0] && iLit != pos[1] && !isFalse(cls[iLit])) {
+                        pos[1] = iLit;
+                        watches[cls[iLit].id(pb)].push_back(iCls);
+                        moved = true;
+                    }
+                }
+                if (moved) {
+                    continue;
+                }
+                watchList[nbKept++] = iCls;
+                if (assign[other.varId] == UNASSIGNED) {
+                    setTrue(other);
+                } else {
+                    conflict(iCls);
+                }
+            }
+            watchList.resize(nbKept);
+        }
+    };
+    propagate();
+
+    for (int iOrder = 0; iOrder < pb.nVars; iOrder++) {
+        int iVar = order ? (*order)[iOrder] : iOrder;
+        if (assign[iVar] == UNASSIGNED) {
+            setTrue({iVar, polarity ? (bool)(*polarity)[iVar] : (randInt() % 2 == 1)});
+            propagate();
+        }
+    }
+    return assign;
+}
+
+
 /*
     Algorithms
 */
-Assignment applyWalkSat(const SatProblem& pb, const Assignment& prevAssign, int flipBudget, float randEps, bool applyNovelty) {
+// Buffers of the WalkSat calls, kept by each thread (scheduler worker) from one call to the next
+struct WalkSatWorkspace {
+    vector<int> clsNbLitTrue;
+    vector<int> consideredVars;
+    vector<int> unverified;
+    vector<tuple<int, int, int>> breakScoreVars; // (BreakScore, randInt(), varId)
+};
+
+thread_local WalkSatWorkspace walkSatWorkspace;
+
+Assignment applyWalkSat(const SatProblem& pb, const Assignment& prevAssign, int flipBudget, float randEps, bool applyNovelty,
+        const vector<int>* clsNbTrue) {
     /* Every variable should be assigned prior to calling this function */
     auto assign = prevAssign;
-    vector<int> clsNbLitTrue(pb.nClauses, 0);
+    auto& [clsNbLitTrue, consideredVars, unverified, breakScoreVars] = walkSatWorkspace;
     int nbUnverified = 0; // Number of unverified clauses
+    if (clsNbTrue != nullptr) {
+        clsNbLitTrue.assign(begin(*clsNbTrue), end(*clsNbTrue));
+    } else {
+        clsNbLitTrue.assign(pb.nClauses, 0);
+    }
     
-    // Compute the number of literals satifying each clause
+    // Compute the number of literals satifying each clause, if not given
     for (int iCls = 0; iCls < pb.nClauses; iCls++) {
-        for (const Literal& lit : pb.clauses[iCls]) {
-            if (assign[lit.varId] == lit.isTrue) {
-                clsNbLitTrue[iCls] += 1;
+        if (clsNbTrue == nullptr) {
+            for (const Literal& lit : pb.clauses[iCls]) {
+                if (assign[lit.varId] == lit.isTrue) {
+                    clsNbLitTrue[iCls] += 1;
+                }
             }
         }
         if (clsNbLitTrue[iCls] == 0) {
@@ -234,12 +437,12 @@ Assignment applyWalkSat(const SatProblem& pb, const Assignment& prevAssign, int
 
     // Loop over the flip budget
     for (int iFlip = 0; iFlip < flipBudget; iFlip++) {
-        vector<int> consideredVars;
+        consideredVars.clear();
         if (applyNovelty) {
-            consideredVars = vector<int>(pb.nVars);
+            consideredVars.resize(pb.nVars);
             iota(begin(consideredVars), end(consideredVars), 0);
         } else {
-            vector<int> unverified;
+            unverified.clear();
             for (int iCls = 0; iCls < pb.nClauses; iCls++) {
                 if (clsNbLitTrue[iCls] == 0) {
                     unverified.push_back(iCls);
@@ -248,13 +451,13 @@ Assignment applyWalkSat(const SatProblem& pb, const Assignment& prevAssign, int
             if (unverified.empty()) { // All clauses are verified \o/
                 break;
             }
-            const Clause& clsSwap = pb.clauses[unverified[rand() % unverified.size()]];
+            const Clause& clsSwap = pb.clauses[unverified[randInt() % unverified.size()]];
             for (const Literal& lit : clsSwap) {
                 consideredVars.push_back(lit.varId);
             }
         }
         
-        vector<tuple<int, int, int>> breakScoreVars; // (BreakScore, rand(), varId)
+        breakScoreVars.clear();
         for (int iVar : consideredVars) {
             int nbBreaking = 0;
             for (int linkedClsId : pb.clausesUsingLit[iVar][assign[iVar]]) {
@@ -264,7 +467,7 @@ Assignment applyWalkSat(const SatProblem& pb, const Assignment& prevAssign, int
                     nbBreaking -= 1; // If the variable is set to true, it will make the clause true
                 }
             }
-            breakScoreVars.push_back({nbBreaking, rand(), iVar});
+            breakScoreVars.push_back({nbBreaking, randInt(), iVar});
         }
         sort(begin(breakScoreVars), end(breakScoreVars));
         if (breakScoreVars.size() >= 2 && get<2>(breakScoreVars[0]) == lastFlippedVar) {
@@ -279,11 +482,11 @@ Assignment applyWalkSat(const SatProblem& pb, const Assignment& prevAssign, int
         // }
         // Choose the variable to flip
         int flipVar = -1;
-        float randValue = rand() / (float)RAND_MAX;
+        float randValue = randFloat();
         if (get<0>(breakScoreVars[0]) < 0) { // If the first variable improves the configuration
             flipVar = get<2>(breakScoreVars[0]);
         } else if (randValue < randEps) { // Sometimes, choose a random var
-            flipVar = get<2>(breakScoreVars[rand()%breakScoreVars.size()]);
+            flipVar = get<2>(breakScoreVars[randInt()%breakScoreVars.size()]);
         } else { // Take the minimum breaking var
             flipVar = get<2>(breakScoreVars[0]);
         }
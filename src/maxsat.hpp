@@ -3,8 +3,11 @@
 
 #include <vector>
 #include <array>
+#include <memory>
 
 struct SatProblem;
+struct Marginals;
+struct MarginalsCache;
 
 struct Literal {
     int varId;
@@ -24,12 +27,21 @@ struct SatProblem {
     std::vector<std::vector<int>> clausesUsingVar;
     std::vector<std::array<std::vector<int>, 2>> clausesUsingLit;
 
+    // Static heuristics, computed once from all the clauses
+    std::vector<std::array<int, 2>> nbTimesAsLit; // Occurrences of each literal, by [varId][isTrue]
+    Assignment staticPolarity; // Most frequent literal of each variable (true if tied)
+    std::vector<int> varsByOccurrences; // H2: decreasing number of occurrences of the variable, then by id
+    std::vector<int> varsByMaxLiteral; // H3: decreasing occurrences of its most frequent literal, then by id
+    std::shared_ptr<MarginalsCache> marginalsCache;
+
     SatProblem(std::vector<Clause>& initClauses, int initNVars=0);
 
     Assignment freeAssignment() const;
     Assignment randomAssignment() const;
     std::vector<int> unverifiedClauses(const Assignment&) const;
+    std::vector<int> nbTrueByClause(const Assignment&) const; // Number of true literals of each clause
     int score(const Assignment&) const;
+    const Marginals& marginals() const; // Message passing marginals, computed on the first call
 };
 
 const Value UNASSIGNED = -1;
@@ -52,9 +64,21 @@ Assignment assignInOrderH1Dynamic(const SatProblem&, const Assignment&);
 Assignment assignMostFrequentVarH2Dynamic(const SatProblem&, const Assignment&);
 Assignment assignMostFrequentLitH3Dynamic(const SatProblem&, const Assignment&);
 
+// Each unassigned variable takes its value in polarity
+Assignment assignWithPolarity(const SatProblem&, const Assignment&, const Assignment& polarity);
+
+// Each variable takes the value of largest marginal
+Assignment assignMarginals(const SatProblem&, const Assignment&);
+
+// Greedy completion in the given order (by id if null) and polarity (random if null), running unit propagation
+// after each assignment. Clauses falsified on the way are tolerated, and their number is added to nbConflicts
+Assignment assignWithPropagation(const SatProblem&, const Assignment&, const std::vector<int>* order,
+    const Assignment* polarity, long long& nbConflicts);
+
 /*
     Algorithms
 */
-Assignment applyWalkSat(const SatProblem&, const Assignment&, int, float, bool);
+// The number of true literals of each clause in the assignment can be given, else it is computed
+Assignment applyWalkSat(const SatProblem&, const Assignment&, int, float, bool, const std::vector<int>* clsNbTrue = nullptr);
 
 #endif
\ No newline at end of file
@@ -1,8 +1,15 @@
 #include <iostream>
 #include <algorithm>
+#include <unordered_set>
 #include <cassert>
+#include <cmath>
+#include <shared_mutex>
+#include <thread>
+#include <optional>
 
 #include "mc.hpp"
+#include "marginals.hpp"
+#include "scheduler.hpp"
 
 using namespace std;
 
@@ -21,12 +28,16 @@ MCSettings::MCSettings(){
     // Rollout heuristic + algorithm (MCTS, NMCS)
     rolloutHeuristic = 3;
     dynamicHeuristic = false;
-    flipAlgorithm = "walksat";
+    rolloutPropagation = false;
+    phasePool = 1; // Only the best assignment
+    phaseEps = 0;
+    rolloutCache = 0;
+    flipAlgorithm = FlipAlgorithm::WalkSat;
     walkBudgetPerVar = 2;
     walkEps = 0.2;
 
     steps = 100; // Steps for MCTS and budget of Sequential Halving ; number of repeats for NMCS or rollout
-    behavior = "once"; // once for running only form root ; full for looping, discounted for looping faster
+    behavior = Behavior::Once; // once for running only form root ; full for looping, discounted for looping faster
     amaf = 0; // AMAF coefficient (0 to disable ; currently, only for SH)
     amafBias = 0; // AMAF bias, allows to decrease the AMAF value quadraticly
 
@@ -35,25 +46,133 @@ MCSettings::MCSettings(){
 
     // NMCS only
     nmcsDepth = 1;
+
+    // Tree memory (MCTS, NMCS, SH)
+    treeMemoryMB = 0; // No limit
+
+    // Parallel search (MCTS)
+    nThreads = 1;
+    parallel = ParallelMode::Root; // root for independent trees with merged root statistics, tree for a shared tree
+    syncSteps = 0; // Only merge before each decision
+    virtualLoss = 1;
+
+    // Leaf parallel rollouts (all methods)
+    leafRollouts = 1;
+    leafReduce = LeafReduce::Min;
+
+    // Parallel SH and NMCS
+    parallelDepth = 1;
+
+    // Stop as soon as all the clauses are verified
+    target = 0;
+}
+
+Heuristic MCSettings::rolloutPolicy() const {
+    if (rolloutHeuristic >= 1 && rolloutHeuristic <= 3) {
+        return Heuristic(rolloutHeuristic + (dynamicHeuristic ? 3 : 0));
+    } else if (rolloutHeuristic == 5) { // Marginals have no dynamic version
+        return Heuristic::Marginals;
+    } else if (rolloutHeuristic == 6) {
+        return Heuristic::PhaseSaving;
+    }
+    return Heuristic::Random;
+}
+
+bool MCSettings::usesMarginals() const {
+    return nodeActionVarsHeuristic == 5 || rolloutHeuristic == 5;
+}
+
+bool MCSettings::cachesCompletions() const {
+    Heuristic heuristic = rolloutPolicy();
+    return rolloutCache > 0 && heuristic != Heuristic::Random && heuristic != Heuristic::PhaseSaving;
 }
 
-Assignment applyHeuristic(SatProblem& pb, Assignment& assign, MCSettings& settings) {
-    if (settings.rolloutHeuristic == 1 && !settings.dynamicHeuristic) {
+bool MCSettings::tracksClauses() const {
+    int heuristic = nodeActionVarsHeuristic;
+    return heuristic == 4 || ((heuristic == 2 || heuristic == 3) && nodeActionHeuristicDynamic);
+}
+
+template<Heuristic H, bool Propagate>
+Assignment applyHeuristic(const SatProblem& pb, const Assignment& assign, const Assignment* phases,
+        long long& nbConflicts) {
+    if constexpr (Propagate) { // Variables in the static order of the heuristic
+        if constexpr (H == Heuristic::H2Static || H == Heuristic::H2Dynamic) {
+            return assignWithPropagation(pb, assign, &pb.varsByOccurrences, &pb.staticPolarity, nbConflicts);
+        } else if constexpr (H == Heuristic::H3Static || H == Heuristic::H3Dynamic) {
+            return assignWithPropagation(pb, assign, &pb.varsByMaxLiteral, &pb.staticPolarity, nbConflicts);
+        } else if constexpr (H == Heuristic::Marginals) {
+            const Marginals& marginals = pb.marginals();
+            return assignWithPropagation(pb, assign, &marginals.varsByBias, &marginals.polarity, nbConflicts);
+        } else if constexpr (H == Heuristic::PhaseSaving) {
+            return assignWithPropagation(pb, assign, nullptr, phases, nbConflicts);
+        }
+        return assignWithPropagation(pb, assign, nullptr,
+            (H == Heuristic::Random) ? nullptr : &pb.staticPolarity, nbConflicts);
+    } else if constexpr (H == Heuristic::H1Static) {
         return assignInOrderH1Static(pb, assign);
-    } else if (settings.rolloutHeuristic == 2 && !settings.dynamicHeuristic) {
+    } else if constexpr (H == Heuristic::H2Static) {
         return assignMostFrequentVarH2Static(pb, assign);
-    } else if (settings.rolloutHeuristic == 3 && !settings.dynamicHeuristic) {
+    } else if constexpr (H == Heuristic::H3Static) {
         return assignMostFrequentLitH3Static(pb, assign);
-    } else if (settings.rolloutHeuristic == 1 && settings.dynamicHeuristic) {
+    } else if constexpr (H == Heuristic::H1Dynamic) {
         return assignInOrderH1Dynamic(pb, assign);
-    } else if (settings.rolloutHeuristic == 1 && settings.dynamicHeuristic) {
+    } else if constexpr (H == Heuristic::H2Dynamic) {
         return assignMostFrequentVarH2Dynamic(pb, assign);
-    } else if (settings.rolloutHeuristic == 1 && settings.dynamicHeuristic) {
+    } else if constexpr (H == Heuristic::H3Dynamic) {
         return assignMostFrequentLitH3Dynamic(pb, assign);
+    } else if constexpr (H == Heuristic::Marginals) {
+        return assignMarginals(pb, assign);
+    } else if constexpr (H == Heuristic::PhaseSaving) {
+        return phases ? assignWithPolarity(pb, assign, *phases) : assignAtRandom(pb, assign);
     }
     return assignAtRandom(pb, assign);
 }
 
+template<FlipAlgorithm F>
+Assignment applyFlipAlgorithm(const SatProblem& pb, const MCSettings& settings, const Assignment& assign,
+        const vector<int>* clsNbTrue) {
+    int flipBudget = pb.nVars * settings.walkBudgetPerVar; // TODO: unassigned or total?
+    return applyWalkSat(pb, assign, flipBudget, settings.walkEps, F == FlipAlgorithm::Novelty, clsNbTrue);
+}
+
+template<Heuristic H, FlipAlgorithm F, bool Propagate>
+Assignment rolloutWith(const SatProblem& pb, const MCSettings& settings, const Assignment& assign,
+        const Assignment* phases, long long& nbConflicts) {
+    return applyFlipAlgorithm<F>(pb, settings, applyHeuristic<H, Propagate>(pb, assign, phases, nbConflicts), nullptr);
+}
+
+template<Heuristic H, bool Propagate>
+RolloutPolicy rolloutWithFlip(FlipAlgorithm flipAlgorithm) {
+    if (flipAlgorithm == FlipAlgorithm::Novelty) {
+        return {&rolloutWith<H, FlipAlgorithm::Novelty, Propagate>, &applyHeuristic<H, Propagate>,
+            &applyFlipAlgorithm<FlipAlgorithm::Novelty>};
+    }
+    return {&rolloutWith<H, FlipAlgorithm::WalkSat, Propagate>, &applyHeuristic<H, Propagate>,
+        &applyFlipAlgorithm<FlipAlgorithm::WalkSat>};
+}
+
+template<Heuristic H>
+RolloutPolicy rolloutWithFlip(const MCSettings& settings) {
+    if (settings.rolloutPropagation) {
+        return rolloutWithFlip<H, true>(settings.flipAlgorithm);
+    }
+    return rolloutWithFlip<H, false>(settings.flipAlgorithm);
+}
+
+RolloutPolicy rolloutPolicyFor(const MCSettings& settings) {
+    switch (settings.rolloutPolicy()) {
+        case Heuristic::H1Static: return rolloutWithFlip<Heuristic::H1Static>(settings);
+        case Heuristic::H2Static: return rolloutWithFlip<Heuristic::H2Static>(settings);
+        case Heuristic::H3Static: return rolloutWithFlip<Heuristic::H3Static>(settings);
+        case Heuristic::H1Dynamic: return rolloutWithFlip<Heuristic::H1Dynamic>(settings);
+        case Heuristic::H2Dynamic: return rolloutWithFlip<Heuristic::H2Dynamic>(settings);
+        case Heuristic::H3Dynamic: return rolloutWithFlip<Heuristic::H3Dynamic>(settings);
+        case Heuristic::Marginals: return rolloutWithFlip<Heuristic::Marginals>(settings);
+        case Heuristic::PhaseSaving: return rolloutWithFlip<Heuristic::PhaseSaving>(settings);
+        default: return rolloutWithFlip<Heuristic::Random>(settings);
+    }
+}
+
 /*
     MC Tree
 */
@@ -66,51 +185,163 @@ std::size_t AssignmentHash::operator()(const Assignment& assign) const {
     return h;
 }
 
-vector<Literal> nextActionsFrom(SatProblem& pb, const Assignment& assign, MCSettings& settings) {
+std::size_t AssignmentHash::operator()(const SearchPath& path) const {
+    return path.hash;
+}
+
+bool AssignmentEqual::operator()(const Assignment& a, const Assignment& b) const {
+    return a == b;
+}
+bool AssignmentEqual::operator()(const Assignment& a, const SearchPath& b) const {
+    return a == b.assign;
+}
+bool AssignmentEqual::operator()(const SearchPath& a, const Assignment& b) const {
+    return a.assign == b;
+}
+
+int lookaheadWeight(SearchPath& probe, const Literal& decision) {
+    /* Clauses verified or reduced when setting the literal and propagating the unit clauses, -1 on a conflict.
+    The probe is given back at the same depth. */
+    const SatProblem& pb = *probe.pb;
+    int startDepth = probe.depth();
+    int weight = 0;
+    bool conflict = false;
+    vector<Literal> toSet{decision};
+    for (int iSet = 0; iSet < (int)toSet.size() && !conflict; iSet++) {
+        Literal lit = toSet[iSet];
+        if (probe.assign[lit.varId] != UNASSIGNED) {
+            conflict = (probe.assign[lit.varId] != lit.isTrue);
+            continue;
+        }
+        probe.set(lit);
+        for (int iCls : pb.clausesUsingLit[lit.varId][lit.isTrue]) {
+            weight += (probe.clsNbTrue[iCls] == 1); // Newly verified
+        }
+        for (int iCls : pb.clausesUsingLit[lit.varId][!lit.isTrue]) {
+            if (probe.isVerified(iCls)) {
+                continue;
+            }
+            weight++; // Reduced
+            if (probe.clsNbFalse[iCls] == (int)pb.clauses[iCls].size()) {
+                conflict = true;
+            } else if (probe.isUnit(iCls)) {
+                for (const Literal& clsLit : pb.clauses[iCls]) {
+                    if (probe.assign[clsLit.varId] == UNASSIGNED) {
+                        toSet.push_back(clsLit);
+                    }
+                }
+            }
+        }
+    }
+    probe.undoTo(startDepth);
+    return conflict ? -1 : weight;
+}
+
+vector<pair<long long, int>> lookaheadScores(const SatProblem& pb, const Assignment& assign, const SearchPath* path, int limit) {
+    /* Score of the unassigned variables, ranked by the product of the weights of both polarities.
+    Failed literals come first, as the other polarity is forced. Only the variables with the most frequent
+    literals in the unverified clauses are probed, and all of them share the same probe path. */
+    SearchPath probe = (path != nullptr) ? *path : SearchPath(pb);
+    if (path == nullptr) {
+        for (int iVar = 0; iVar < pb.nVars; iVar++) {
+            if (assign[iVar] != UNASSIGNED) {
+                probe.set({iVar, (bool)assign[iVar]});
+            }
+        }
+    }
+    vector<pair<long long, int>> candidates; // (-score, varId)
+    for (int iVar = 0; iVar < pb.nVars; iVar++) {
+        if (assign[iVar] == UNASSIGNED) {
+            candidates.push_back({-max(probe.nbTimesAsUnverified[iVar][0], probe.nbTimesAsUnverified[iVar][1]), iVar});
+        }
+    }
+    int nProbed = limit ? min((int)candidates.size(), max(16, 4 * limit)) : candidates.size();
+    partial_sort(begin(candidates), begin(candidates) + nProbed, end(candidates));
+    candidates.resize(nProbed);
+
+    for (auto& [score, iVar] : candidates) {
+        long long weightTrue = lookaheadWeight(probe, {iVar, true});
+        long long weightFalse = lookaheadWeight(probe, {iVar, false});
+        if (weightTrue < 0 || weightFalse < 0) {
+            score = -(1LL << 40) - max(weightTrue, weightFalse);
+        } else {
+            score = -(weightTrue * weightFalse * 1024 + weightTrue + weightFalse);
+        }
+    }
+    return candidates;
+}
+
+vector<Literal> nextActionsFrom(const SatProblem& pb, const Assignment& assign, const MCSettings& settings,
+        const SearchPath* path) {
+    /* The path, if given, is at the assignment: its clause counters are used instead of scanning the clauses */
+    if (path != nullptr && !path->trackClauses) {
+        path = nullptr;
+    }
     int sortHeuristic = settings.nodeActionVarsHeuristic;
     int limit = settings.nodeNActionVars;
     vector<pair<int, int>> scoresActions; // (score, action)
     vector<array<int, 2>> nbTimesAs;
+    vector<Literal> actions;
 
-    if (sortHeuristic >= 2) {
-        nbTimesAs = vector<array<int, 2>>(pb.nVars, {0, 0});
-        vector<Clause> clauses;
-        if (settings.nodeActionHeuristicDynamic) {
-            clauses.clear();
-            for (int iCls : pb.unverifiedClauses(assign)) {
-                clauses.push_back(pb.clauses[iCls]);
+    if (sortHeuristic == 4) {
+        auto scores = lookaheadScores(pb, assign, path, limit);
+        int nKeep = (limit && limit < (int)scores.size()) ? limit : scores.size();
+        partial_sort(begin(scores), begin(scores) + nKeep, end(scores));
+        for (int iScore = 0; iScore < nKeep; iScore++) {
+            actions.push_back({scores[iScore].second, true});
+            actions.push_back({scores[iScore].second, false});
+        }
+        return actions;
+    }
+
+    if (sortHeuristic == 1 || sortHeuristic == 5 || (sortHeuristic >= 2 && !settings.nodeActionHeuristicDynamic)) {
+        // Static orders are computed with the problem: take the first unassigned variables
+        const vector<int>* order = (sortHeuristic == 2) ? &pb.varsByOccurrences
+            : (sortHeuristic == 3) ? &pb.varsByMaxLiteral
+            : (sortHeuristic == 5) ? &pb.marginals().varsByBias : nullptr;
+        for (int iOrder = 0; iOrder < pb.nVars && (!limit || actions.size() < 2 * limit); iOrder++) {
+            int iVar = order ? (*order)[iOrder] : iOrder;
+            if (assign[iVar] == UNASSIGNED) {
+                actions.push_back({iVar, true});
+                actions.push_back({iVar, false});
             }
-        } else {
-            clauses = pb.clauses;
         }
-        for (const Clause& cls : clauses) {
-            for (const Literal& lit : cls) {
-                nbTimesAs[lit.varId][lit.isTrue]++;
+        return actions;
+    }
+
+    const vector<array<int, 2>>* counts = nullptr;
+    if (sortHeuristic >= 2) { // Dynamic: only count the clauses left to verify
+        if (path != nullptr) {
+            counts = &path->nbTimesAsUnverified;
+        } else {
+            nbTimesAs = vector<array<int, 2>>(pb.nVars, {0, 0});
+            for (int iCls : pb.unverifiedClauses(assign)) {
+                for (const Literal& lit : pb.clauses[iCls]) {
+                    nbTimesAs[lit.varId][lit.isTrue]++;
+                }
             }
+            counts = &nbTimesAs;
         }
     }
 
     for (int iVar = 0; iVar < pb.nVars; iVar++) {
         if (assign[iVar] == UNASSIGNED) {
-            int score = iVar; // H1: in order
+            int score = iVar;
             if (sortHeuristic == 0) { // H0: Random
-                score = rand();
+                score = randInt();
             } else if (sortHeuristic == 3) { // H3: max literal 
-                score = max(nbTimesAs[iVar][0], nbTimesAs[iVar][1]) * (-1); // -1 to put larger at the beginning
+                score = max((*counts)[iVar][0], (*counts)[iVar][1]) * (-1); // -1 to put larger at the beginning
             } else if (sortHeuristic == 2) { // H2: max variable 
-                score = (nbTimesAs[iVar][0] + nbTimesAs[iVar][1]) * (-1); // -1 to put larger at the beginning
+                score = ((*counts)[iVar][0] + (*counts)[iVar][1]) * (-1); // -1 to put larger at the beginning
             }
             scoresActions.push_back({score, iVar});
         }
     }
-    if (sortHeuristic != 1) {
-        sort(begin(scoresActions), end(scoresActions));
-    }
-    while (limit && scoresActions.size() > limit) {
-        scoresActions.pop_back();
-    }
+    // Only the first limit actions are kept: no need to sort the others
+    int nKeep = (limit && limit < (int)scoresActions.size()) ? limit : scoresActions.size();
+    partial_sort(begin(scoresActions), begin(scoresActions) + nKeep, end(scoresActions));
+    scoresActions.resize(nKeep);
 
-    vector<Literal> actions;
     for (auto& scoreAction : scoresActions) {
         actions.push_back({scoreAction.second, true});
         actions.push_back({scoreAction.second, false});
@@ -118,45 +349,199 @@ vector<Literal> nextActionsFrom(SatProblem& pb, const Assignment& assign, MCSett
     return actions;
 }
 
-MCState::MCState(MCSettings& settings, SatProblem& pb, Assignment& assign) {
+MCState::MCState(const MCSettings& settings, const SatProblem& pb, const Assignment& assign, const SearchPath* path) {
     stateAssign = assign;
     nbTimesSeen = 0;
     nbUnassigned = count(begin(stateAssign), end(stateAssign), UNASSIGNED);
     terminal = (nbUnassigned == 0);
     bestActionId = -1;
+    lastUsed = 0;
+    pinned = 0;
 
-    nextActions = nextActionsFrom(pb, assign, settings);
+    nextActions = nextActionsFrom(pb, assign, settings, path);
     nbSubExplorations = 0;
     actionsNExplorations = vector<int>(nextActions.size(), 0);
     bestScoresForActions = vector<int>(nextActions.size(), 0);
+    children = vector<MCState*>(nextActions.size(), nullptr);
+    actionsVirtualLoss = vector<int>(nextActions.size(), 0);
+    nbVirtualLoss = 0;
+    completionConflicts = 0;
+    completionState = COMPLETION_EMPTY;
     for (int& score : bestScoresForActions) {
-        score = INF - (rand() % 1000000); // Large random number
+        score = INF - (randInt() % 1000000); // Large random number
     }
     // actionsQValues = vector<double>(nextActions.size(), 0); // TODO: which starting value?
     actionsQValues = vector<double>(nextActions.size(), 1);
 }
 
+size_t MCState::memoryUsage() const {
+    return sizeof(MCState)
+        + stateAssign.capacity() * sizeof(Value)
+        + nextActions.capacity() * sizeof(Literal)
+        + actionsNExplorations.capacity() * sizeof(int)
+        + actionsQValues.capacity() * sizeof(double)
+        + bestScoresForActions.capacity() * sizeof(int)
+        + children.capacity() * sizeof(MCState*)
+        + actionsVirtualLoss.capacity() * sizeof(int)
+        + completion.capacity() * sizeof(Value)
+        + completionNbTrue.capacity() * sizeof(int);
+}
+
+template<class S>
+S* MCState::play(MCTSInstance<S>& inst, SearchPath& path, int actionId) {
+    /* The path should be at this state: the action is applied on it, and the child is returned */
+    path.set(nextActions[actionId]);
+    atomic_ref<MCState*> childRef(children[actionId]);
+    S* child = static_cast<S*>(childRef.load(memory_order_acquire));
+    if (child == nullptr) { // First expansion: look for a transposition in the tree, which all threads get
+        child = inst.get(path);
+        childRef.store(child, memory_order_release);
+    }
+    inst.touch(child);
+    return child;
+}
+
+template<class S>
+S* MCState::playPinned(MCTSInstance<S>& inst, SearchPath& path, int actionId) {
+    /* Same as play, but the child is pinned before an eviction by another thread can remove it */
+    inst.beginLookup();
+    S* child = play(inst, path, actionId);
+    atomic_ref<int>(child->pinned)++;
+    inst.endLookup();
+    return child;
+}
+
 template<class S>
 int MCState::rolloutValue(MCTSInstance<S>& inst) {
-    auto nextAssign = applyHeuristic(inst.pb, stateAssign, inst.settings);
-    nextAssign = applyFlipAlgorithm(inst, nextAssign, nbUnassigned);
+    int nbRollouts = inst.settings.leafRollouts;
+    if (nbRollouts <= 1) {
+        return rolloutOnce(inst);
+    }
+    /* Batch of rollouts run in parallel. Each one has its own random stream, given by the seed and the
+    number of previous batches, so that the result does not depend on the threads. For the same reason,
+    the phase saving rollouts pick from the elites before the batch, and the best assignment and the elites
+    are only updated after it, in the order of the rollouts. */
+    uint64_t iBatch = inst.nbRolloutBatches++;
+    vector<int> scores(nbRollouts);
+    vector<Assignment> assigns(nbRollouts);
+    vector<Assignment> elites;
+    if (inst.elites.capacity > 0) {
+        inst.elites.snapshot(elites);
+    }
+    parallelFor(nbRollouts, [&](int iRollout) {
+        seedRandom(streamSeed(inst.settings.seed, iBatch * nbRollouts + iRollout));
+        scores[iRollout] = rolloutOnce(inst, &elites, &assigns[iRollout]);
+    });
+    for (int iRollout = 0; iRollout < nbRollouts; iRollout++) {
+        inst.updateBest(assigns[iRollout], scores[iRollout]);
+    }
+
+    if (inst.settings.leafReduce == LeafReduce::Mean) {
+        double sumScores = 0;
+        for (int score : scores) {
+            sumScores += score;
+        }
+        return (int)round(sumScores / nbRollouts);
+    }
+    return *min_element(begin(scores), end(scores));
+}
+
+// Phases of the rollouts of each thread
+thread_local Assignment phasesWorkspace;
+
+template<class S>
+int MCState::rolloutOnce(MCTSInstance<S>& inst, const vector<Assignment>* elites, Assignment* outAssign) {
+    long long nbConflicts = 0;
+    const Assignment* phases = nullptr;
+    Assignment& elitePhases = phasesWorkspace;
+    bool picked = false;
+    if (elites != nullptr && !elites->empty()) { // Empty without phase saving
+        elitePhases = (*elites)[randInt() % elites->size()];
+        picked = true;
+    } else if (elites == nullptr && inst.elites.capacity > 0) {
+        picked = inst.elites.pick(elitePhases);
+    }
+    if (picked) { // Phase saving: an elite, with random perturbations
+        if (inst.settings.phaseEps > 0) {
+            for (Value& phase : elitePhases) {
+                if (randFloat() < inst.settings.phaseEps) {
+                    phase = randInt() % 2;
+                }
+            }
+        }
+        phases = &elitePhases;
+    }
+    Assignment nextAssign;
+    if (inst.settings.cachesCompletions()) { // Only the flips are run again
+        fillCompletion(inst);
+        nbConflicts = completionConflicts;
+        nextAssign = inst.rollout.flip(inst.pb, inst.settings, completion,
+            completionNbTrue.empty() ? nullptr : &completionNbTrue);
+    } else {
+        nextAssign = inst.rollout.run(inst.pb, inst.settings, stateAssign, phases, nbConflicts);
+    }
+    if (nbConflicts) {
+        inst.nbConflicts += nbConflicts;
+    }
     int score = inst.pb.score(nextAssign);
-    inst.updateBest(nextAssign, score);
+    if (outAssign != nullptr) {
+        *outAssign = std::move(nextAssign);
+    } else {
+        inst.updateBest(nextAssign, score);
+    }
 
     return score;
 }
 
 template<class S>
-Literal MCState::getUCBAction(MCTSInstance<S>& inst, bool allowExploration) {
+void MCState::fillCompletion(MCTSInstance<S>& inst) {
+    /* Computed by each thread rolling out the node before it is stored, and stored by the first one to finish,
+    which the others wait for. It is never changed after, so the completion can then be read without waiting. */
+    atomic_ref<int> state(completionState);
+    if (state.load(memory_order_acquire) == COMPLETION_STORED) {
+        return;
+    }
+
+    long long nbConflicts = 0;
+    Assignment newCompletion = inst.rollout.complete(inst.pb, stateAssign, nullptr, nbConflicts);
+    vector<int> newNbTrue;
+    if (inst.settings.rolloutCache >= 2) {
+        newNbTrue = inst.pb.nbTrueByClause(newCompletion);
+    }
+    int expected = COMPLETION_EMPTY;
+    if (state.compare_exchange_strong(expected, COMPLETION_STORING, memory_order_acquire)) {
+        completion = std::move(newCompletion);
+        completionNbTrue = std::move(newNbTrue);
+        completionConflicts = nbConflicts;
+        state.store(COMPLETION_STORED, memory_order_release);
+        // Counted now, as the node was counted with its memory at creation
+        inst.addTreeBytes(completion.capacity() * sizeof(Value) + completionNbTrue.capacity() * sizeof(int));
+    } else {
+        while (state.load(memory_order_acquire) != COMPLETION_STORED) {
+            this_thread::yield();
+        }
+    }
+}
+
+template<class S>
+int MCState::getUCBActionId(MCTSInstance<S>& inst, bool allowExploration) {
     int ucbBestId = -1;
     double bestUCTVal = 0;
     double ucbCExplo = allowExploration ? inst.settings.ucbCExplo : 0;
     // cerr << "Actions: ";
     for (int iAction = 0; iAction < (int)nextActions.size(); iAction++) {
-        double N_c = actionsNExplorations[iAction];
-        double N_tot = max(nbSubExplorations, 1);
+        // Pending parallel descents count as explorations that gave the worst value
+        int nExplorations = atomic_ref<int>(actionsNExplorations[iAction]).load(memory_order_relaxed);
+        int virtualLoss = atomic_ref<int>(actionsVirtualLoss[iAction]).load(memory_order_relaxed);
+        double N_c = nExplorations + virtualLoss;
+        double N_tot = max(atomic_ref<int>(nbSubExplorations).load(memory_order_relaxed)
+            + atomic_ref<int>(nbVirtualLoss).load(memory_order_relaxed), 1);
+        double qValue = atomic_ref<double>(actionsQValues[iAction]).load(memory_order_relaxed);
+        if (virtualLoss) {
+            qValue *= nExplorations / N_c;
+        }
         double uctVal = (
-            actionsQValues[iAction]
+            qValue
             + ucbCExplo * sqrt(log(N_tot) / (N_c + 1.))
         );
         if (ucbBestId == -1 || bestUCTVal < uctVal) {
@@ -167,7 +552,12 @@ Literal MCState::getUCBAction(MCTSInstance<S>& inst, bool allowExploration) {
         // cerr << "[N_c=" << N_c << ", N_tot=" << N_tot << ", q=" << actionsQValues[iAction] << "] ";
     }
     // cerr << endl << endl;
-    return nextActions[ucbBestId];
+    return ucbBestId;
+}
+
+template<class S>
+Literal MCState::getUCBAction(MCTSInstance<S>& inst, bool allowExploration) {
+    return nextActions[getUCBActionId(inst, allowExploration)];
 }
 
 int MCState::getActionId(const Literal& action) {
@@ -183,18 +573,99 @@ int MCState::getActionId(const Literal& action) {
 
 template<class S>
 void MCState::updateAfterAction(MCTSInstance<S>& inst, Literal action, int score) {
-    int actionId = this->getActionId(action);
-    for (int i = 0; i < (int)nextActions.size(); i++) {
-        if (action == nextActions[i]) {
-            actionId = i;
+    updateAfterActionId(inst, this->getActionId(action), score);
+}
+
+template<class S>
+void MCState::updateAfterActionId(MCTSInstance<S>& inst, int actionId, int score) {
+    /* Lock-free: concurrent updates of an action each add their value with the count they got */
+    double N_c = atomic_ref<int>(actionsNExplorations[actionId]).fetch_add(1, memory_order_relaxed);
+    double score_value = (double)(inst.pb.nClauses - score) / inst.pb.nClauses; // Fraction of OK clauses
+    atomic_ref<double> qValue(actionsQValues[actionId]);
+    double prevQValue = qValue.load(memory_order_relaxed);
+    while (!qValue.compare_exchange_weak(prevQValue, (N_c * prevQValue + score_value) / (N_c + 1.), memory_order_relaxed)) {
+    }
+    atomic_ref<int>(nbSubExplorations).fetch_add(1, memory_order_relaxed);
+}
+
+
+/*
+    Search path
+*/
+
+SearchPath::SearchPath(const SatProblem& _pb, bool _trackClauses) : pb(&_pb), trackClauses(_trackClauses) {
+    assign = pb->freeAssignment();
+    hash = AssignmentHash{}(assign);
+    trail.reserve(assign.size());
+    auto weights = make_shared<vector<uint>>(assign.size());
+    uint weight = 1;
+    for (int iVar = (int)assign.size() - 1; iVar >= 0; iVar--) {
+        (*weights)[iVar] = weight;
+        weight = (uint64_t)weight * 3 % HASH_MOD;
+    }
+    hashWeights = weights;
+    if (trackClauses) {
+        clsNbTrue = vector<int>(pb->nClauses, 0);
+        clsNbFalse = vector<int>(pb->nClauses, 0);
+        nbTimesAsUnverified = pb->nbTimesAsLit;
+    }
+}
+
+int SearchPath::depth() const {
+    return trail.size();
+}
+
+bool SearchPath::isVerified(int iCls) const {
+    return clsNbTrue[iCls] > 0;
+}
+
+bool SearchPath::isUnit(int iCls) const {
+    return clsNbTrue[iCls] == 0 && clsNbFalse[iCls] + 1 == (int)pb->clauses[iCls].size();
+}
+
+void SearchPath::set(const Literal& lit) {
+    assert((assign[lit.varId] == UNASSIGNED));
+    assign[lit.varId] = lit.isTrue;
+    hash = (hash + (uint64_t)(*hashWeights)[lit.varId] * (lit.isTrue + 1)) % HASH_MOD;
+    trail.push_back(lit.varId);
+    if (!trackClauses) {
+        return;
+    }
+    for (int iCls : pb->clausesUsingLit[lit.varId][lit.isTrue]) {
+        if (clsNbTrue[iCls]++ == 0) { // Newly verified
+            for (const Literal& clsLit : pb->clauses[iCls]) {
+                nbTimesAsUnverified[clsLit.varId][clsLit.isTrue]--;
+            }
         }
     }
-    assert((actionId >= 0));
-    double N_c = actionsNExplorations[actionId];
-    double score_value = (double)(inst.pb.nClauses - score) / inst.pb.nClauses; // Fraction of OK clauses
-    actionsQValues[actionId] = (N_c * actionsQValues[actionId] + score_value) / (N_c + 1.);
-    actionsNExplorations[actionId] += 1;
-    nbSubExplorations += 1;
+    for (int iCls : pb->clausesUsingLit[lit.varId][!lit.isTrue]) {
+        clsNbFalse[iCls]++;
+    }
+}
+
+void SearchPath::undo() {
+    int iVar = trail.back();
+    trail.pop_back();
+    hash = (hash + HASH_MOD - (uint64_t)(*hashWeights)[iVar] * (assign[iVar] + 1) % HASH_MOD) % HASH_MOD;
+    if (trackClauses) {
+        for (int iCls : pb->clausesUsingLit[iVar][assign[iVar]]) {
+            if (--clsNbTrue[iCls] == 0) { // Not verified anymore
+                for (const Literal& clsLit : pb->clauses[iCls]) {
+                    nbTimesAsUnverified[clsLit.varId][clsLit.isTrue]++;
+                }
+            }
+        }
+        for (int iCls : pb->clausesUsingLit[iVar][!assign[iVar]]) {
+            clsNbFalse[iCls]--;
+        }
+    }
+    assign[iVar] = UNASSIGNED;
+}
+
+void SearchPath::undoTo(int prevDepth) {
+    while (depth() > prevDepth) {
+        undo();
+    }
 }
 
 
@@ -202,17 +673,161 @@ void MCState::updateAfterAction(MCTSInstance<S>& inst, Literal action, int score
     MC Instances
 */
 
+BestSolution::BestSolution(int nVars) : score(INF), sequence(0), assignScore(INF), assign(nVars, UNASSIGNED) {
+}
+
+ElitePool::ElitePool(int _capacity, int nVars)
+        : capacity(_capacity), worstScore(_capacity > 0 ? INF : -INF), sequence(0), nbElites(0),
+        scores(_capacity, INF), elites(_capacity, Assignment(nVars, UNASSIGNED)) {
+}
+
+void ElitePool::offer(const Assignment& assign, int score) {
+    if (score >= worstScore.load(memory_order_relaxed)) { // Most rollouts stop here once the pool is full
+        return;
+    }
+    lock_guard<mutex> guard(lock); // Only the offers write: the elites can be read here without atomics
+    int nbStored = nbElites.load(memory_order_relaxed);
+    if (score >= worstScore.load(memory_order_relaxed)) {
+        return;
+    }
+    for (int iElite = 0; iElite < nbStored; iElite++) {
+        if (scores[iElite] == score && elites[iElite] == assign) {
+            return;
+        }
+    }
+    int iSlot = nbStored;
+    if (nbStored == capacity) { // Replace the worst elite
+        iSlot = max_element(begin(scores), end(scores)) - begin(scores);
+    }
+
+    uint64_t seq = sequence.load(memory_order_relaxed);
+    sequence.store(seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    scores[iSlot] = score;
+    for (int iVar = 0; iVar < (int)assign.size(); iVar++) {
+        atomic_ref<Value>(elites[iSlot][iVar]).store(assign[iVar], memory_order_relaxed);
+    }
+    if (iSlot == nbStored) {
+        nbElites.store(++nbStored, memory_order_relaxed);
+    }
+    sequence.store(seq + 2, memory_order_release);
+    worstScore.store(nbStored == capacity ? *max_element(begin(scores), end(scores)) : INF, memory_order_relaxed);
+}
+
+bool ElitePool::pick(Assignment& outAssign) const {
+    while (true) {
+        uint64_t seq = sequence.load(memory_order_acquire);
+        if (seq % 2 == 1) {
+            this_thread::yield();
+            continue;
+        }
+        int nbStored = nbElites.load(memory_order_relaxed);
+        if (nbStored == 0) {
+            return false;
+        }
+        const Assignment& elite = elites[randInt() % nbStored];
+        outAssign.resize(elite.size());
+        for (int iVar = 0; iVar < (int)elite.size(); iVar++) {
+            outAssign[iVar] = atomic_ref<const Value>(elite[iVar]).load(memory_order_relaxed);
+        }
+        atomic_thread_fence(memory_order_acquire);
+        if (sequence.load(memory_order_relaxed) == seq) {
+            return true;
+        }
+    }
+}
+
+void ElitePool::snapshot(vector<Assignment>& outElites) const {
+    while (true) {
+        uint64_t seq = sequence.load(memory_order_acquire);
+        if (seq % 2 == 1) {
+            this_thread::yield();
+            continue;
+        }
+        outElites.resize(nbElites.load(memory_order_relaxed));
+        for (int iElite = 0; iElite < (int)outElites.size(); iElite++) {
+            outElites[iElite].resize(elites[iElite].size());
+            for (int iVar = 0; iVar < (int)elites[iElite].size(); iVar++) {
+                outElites[iElite][iVar] = atomic_ref<const Value>(elites[iElite][iVar]).load(memory_order_relaxed);
+            }
+        }
+        atomic_thread_fence(memory_order_acquire);
+        if (sequence.load(memory_order_relaxed) == seq) {
+            return;
+        }
+    }
+}
+
+bool BestSolution::update(const Assignment& newAssign, int newScore) {
+    int prevScore = score.load(memory_order_relaxed);
+    do { // Most rollouts don't improve the score, and stop here
+        if (newScore >= prevScore) {
+            return false;
+        }
+    } while (!score.compare_exchange_weak(prevScore, newScore, memory_order_relaxed));
+
+    // Only one writer at a time: take the sequence from even to odd
+    uint64_t seq = sequence.load(memory_order_relaxed);
+    while (seq % 2 == 1 || !sequence.compare_exchange_weak(seq, seq + 1, memory_order_acquire)) {
+        seq = sequence.load(memory_order_relaxed);
+    }
+    atomic_thread_fence(memory_order_release);
+    if (score.load(memory_order_relaxed) == newScore) { // Else a better assignment is being published
+        atomic_ref<int>(assignScore).store(newScore, memory_order_relaxed);
+        for (int iVar = 0; iVar < (int)assign.size(); iVar++) {
+            atomic_ref<Value>(assign[iVar]).store(newAssign[iVar], memory_order_relaxed);
+        }
+    }
+    sequence.store(seq + 2, memory_order_release);
+    return true;
+}
+
+int BestSolution::read(Assignment& outAssign) const {
+    outAssign.resize(assign.size());
+    while (true) {
+        uint64_t seq = sequence.load(memory_order_acquire);
+        if (seq % 2 == 1) {
+            this_thread::yield();
+            continue;
+        }
+        int outScore = atomic_ref<const int>(assignScore).load(memory_order_relaxed);
+        for (int iVar = 0; iVar < (int)assign.size(); iVar++) {
+            outAssign[iVar] = atomic_ref<const Value>(assign[iVar]).load(memory_order_relaxed);
+        }
+        atomic_thread_fence(memory_order_acquire);
+        if (sequence.load(memory_order_relaxed) == seq) {
+            return outScore;
+        }
+    }
+}
+
 template<class S>
 MCTSInstance<S>::MCTSInstance(const MCSettings& _settings, const SatProblem& _pb)
-    :settings(_settings), pb(_pb), tree() {
-    bestAssignment = pb.randomAssignment();
-    minUnverified = pb.score(bestAssignment);
+    :settings(_settings), pb(_pb), rollout(rolloutPolicyFor(_settings)), tree(), clock(0), nbRolloutBatches(0), nbLookups(0), evicting(false), treeBytes(0), peakTreeBytes(0), nbEvicted(0), nbReleased(0), nbConflicts(0), best(_pb.nVars),
+    elites(_settings.rolloutPolicy() == Heuristic::PhaseSaving ? max(1, _settings.phasePool) : 0, _pb.nVars) {
+    sharedBest = nullptr;
+    treeMemoryLimit = (size_t)settings.treeMemoryMB << 20;
+    if (settings.usesMarginals()) { // Before the searches, whose tasks could wait for the message passing ones
+        pb.marginals();
+    }
+    Assignment initAssign = pb.randomAssignment();
+    updateBest(initAssign); // Also the first elite
     amafCount = vector<int>(pb.nVars*2, 0);
     amafMin = vector<double>(pb.nVars*2, INF);
 }
 
+template<class S>
+MCTSInstance<S>::~MCTSInstance() {
+    for (auto& shard : tree.shards) {
+        for (auto& entry : shard.nodes) {
+            entry.second->~S(); // The storage is released with the arena
+        }
+    }
+}
+
 template<class S>
 void MCTSInstance<S>::amafAddResult(const Literal& lit, double score, int count) {
+    lock_guard<mutex> guard(amafLock);
     int litId = lit.id(pb);
     amafCount[litId] += count;
     amafMin[litId] = min(score, amafMin[litId]);
@@ -220,6 +835,7 @@ void MCTSInstance<S>::amafAddResult(const Literal& lit, double score, int count)
 
 template<class S>
 double MCTSInstance<S>::amafGet(const Literal& lit, double realValue, int count) {
+    lock_guard<mutex> guard(amafLock);
     int litId = lit.id(pb);
     if (!amafCount[litId]) {
         return realValue;
@@ -230,23 +846,213 @@ double MCTSInstance<S>::amafGet(const Literal& lit, double realValue, int count)
     return realValue * (1 - amafCoeff) + amafMin[litId] * amafCoeff;
 }
 
+// Approximation of the memory used by the tree for each node, besides the node itself
+static size_t treeEntryMemory(const Assignment& key) {
+    return sizeof(Assignment) + key.capacity() * sizeof(Value) + 4 * sizeof(void*);
+}
+
 template<class S>
 S* MCTSInstance<S>::get(Assignment& assign) {
-    if (tree.find(assign) == tree.end()) {
-        tree.insert({assign, unique_ptr<S>(new S{settings, pb, assign})});
+    return findOrCreate(assign, assign);
+}
+
+template<class S>
+S* MCTSInstance<S>::get(SearchPath& path) {
+    return findOrCreate(path, path.assign); // Looks up with the path hash, without copying the assignment
+}
+
+template<class S>
+template<class Key>
+S* MCTSInstance<S>::findOrCreate(const Key& key, const Assignment& assign) {
+    auto& shard = tree.shardOf(AssignmentHash{}(key));
+    {
+        shared_lock<shared_mutex> readGuard(shard.lock);
+        auto it = shard.nodes.find(key);
+        if (it != shard.nodes.end()) {
+            touch(it->second);
+            return it->second;
+        }
+    }
+    const SearchPath* path = nullptr;
+    if constexpr (is_same_v<Key, SearchPath>) {
+        path = &key;
+    }
+    S newState{settings, pb, assign, path}; // Built outside of the lock, as it is the costly part
+    unique_lock<shared_mutex> writeGuard(shard.lock);
+    auto it = shard.nodes.find(key);
+    if (it == shard.nodes.end()) { // Not inserted by another thread in between
+        it = shard.nodes.insert({assign, arena.create(std::move(newState))}).first;
+        addTreeBytes(treeEntryMemory(it->first) + it->second->memoryUsage());
+    }
+    touch(it->second);
+    return it->second;
+}
+
+template<class S>
+void MCTSInstance<S>::addTreeBytes(size_t nbBytes) {
+    size_t newBytes = treeBytes.fetch_add(nbBytes, memory_order_relaxed) + nbBytes;
+    size_t peakBytes = peakTreeBytes.load(memory_order_relaxed);
+    while (peakBytes < newBytes && !peakTreeBytes.compare_exchange_weak(peakBytes, newBytes, memory_order_relaxed)) {
+    }
+}
+
+template<class S>
+void MCTSInstance<S>::touch(S* state) {
+    atomic_ref<uint64_t>(state->lastUsed).store(++clock, memory_order_relaxed);
+}
+
+template<class S>
+void MCTSInstance<S>::beginLookup() {
+    while (true) {
+        nbLookups++;
+        if (!evicting) {
+            return;
+        }
+        nbLookups--;
+        while (evicting) {
+            this_thread::yield();
+        }
+    }
+}
+
+template<class S>
+void MCTSInstance<S>::endLookup() {
+    nbLookups--;
+}
+
+template<class S>
+void MCTSInstance<S>::limitTreeMemory() {
+    /* Evict the least recently used nodes (then the least visited) once over budget, down to 3/4 of it.
+    Other threads may be searching: only the nodes they pinned are used, and no lookup runs meanwhile,
+    so the unpinned nodes and the tree itself are not accessed by them. */
+    size_t limit = treeMemoryLimit;
+    if (!limit || treeBytes <= limit) {
+        return;
+    }
+    unique_lock<mutex> evictionGuard(evictionLock, try_to_lock);
+    if (!evictionGuard.owns_lock()) { // Another thread is evicting
+        return;
+    }
+    evicting = true;
+    while (nbLookups > 0) {
+        this_thread::yield();
+    }
+    vector<tuple<uint64_t, int, S*>> candidates; // (lastUsed, nbTimesSeen, state)
+    for (auto& shard : tree.shards) {
+        for (auto& entry : shard.nodes) {
+            if (!atomic_ref<int>(entry.second->pinned).load()) { // Can't be pinned by another thread meanwhile
+                candidates.push_back({entry.second->lastUsed, entry.second->nbTimesSeen, entry.second});
+            }
+        }
+    }
+    sort(begin(candidates), end(candidates));
+
+    unordered_set<MCState*> evicted;
+    size_t target = limit / 4 * 3;
+    for (auto& candidate : candidates) {
+        if (treeBytes <= target) {
+            break;
+        }
+        S* state = std::get<2>(candidate);
+        evicted.insert(state);
+        treeBytes -= treeEntryMemory(state->stateAssign) + state->memoryUsage();
+    }
+
+    // Remove evicted nodes, and the links to them from the remaining ones
+    for (auto& shard : tree.shards) {
+        for (auto it = shard.nodes.begin(); it != shard.nodes.end(); ) {
+            if (evicted.count(it->second)) {
+                arena.destroy(it->second);
+                it = shard.nodes.erase(it);
+            } else {
+                for (MCState*& child : it->second->children) {
+                    if (child != nullptr && evicted.count(child)) {
+                        child = nullptr;
+                    }
+                }
+                it++;
+            }
+        }
+    }
+    nbEvicted += evicted.size();
+    evicting = false;
+}
+
+template<class S>
+S* MCTSInstance<S>::reroot(S* root, const Literal& committed) {
+    /* Keep only the nodes that can still be reached after committing an action to get the new root,
+    compacted in a fresh arena in depth-first order from it. The other ones are dropped at once with
+    the previous arena and tree.
+    All the nodes should extend the previous root, so only the committed literal has to be checked. */
+    NodeArena<S> prevArena;
+    MCTree<S> prevTree;
+    arena.swap(prevArena);
+    tree.swap(prevTree);
+    treeBytes = 0;
+
+    unordered_map<MCState*, S*> movedTo;
+    auto moveNode = [&](S* state) {
+        S* moved = arena.create(std::move(*state));
+        movedTo[state] = moved;
+        tree.insert(moved->stateAssign, moved);
+        treeBytes += treeEntryMemory(moved->stateAssign) + moved->memoryUsage();
+    };
+    vector<S*> toVisit{root};
+    while (!toVisit.empty()) {
+        S* state = toVisit.back();
+        toVisit.pop_back();
+        if (movedTo.count(state)) { // Transposition, already moved
+            continue;
+        }
+        for (int iAction = (int)state->children.size() - 1; iAction >= 0; iAction--) {
+            if (state->children[iAction] != nullptr) {
+                toVisit.push_back(static_cast<S*>(state->children[iAction]));
+            }
+        }
+        moveNode(state);
+    }
+    // Nodes not linked from the new root, but that it can reach by transposition
+    for (auto& shard : prevTree.shards) {
+        for (auto& entry : shard.nodes) {
+            if (!movedTo.count(entry.second) && entry.first[committed.varId] == committed.isTrue) {
+                moveNode(entry.second);
+            }
+        }
+    }
+    for (auto& shard : tree.shards) {
+        for (auto& entry : shard.nodes) {
+            for (MCState*& child : entry.second->children) {
+                if (child != nullptr) {
+                    child = movedTo.at(child);
+                }
+            }
+        }
+    }
+
+    nbReleased += prevTree.size() - tree.size();
+    for (auto& shard : prevTree.shards) {
+        for (auto& entry : shard.nodes) {
+            entry.second->~S();
+        }
     }
-    return tree.at(assign).get();
+    return movedTo.at(root);
 }
 
 template<class S>
-void MCTSInstance<S>::updateBest(Assignment& assign, int nbUnverified) {
+void MCTSInstance<S>::updateBest(const Assignment& assign, int nbUnverified) {
     if (nbUnverified < 0) {
         nbUnverified = pb.score(assign);
     }
-    if (nbUnverified < minUnverified) {
-        minUnverified = nbUnverified;
-        bestAssignment = assign;
+    if (best.update(assign, nbUnverified) && sharedBest != nullptr) {
+        sharedBest->update(assign, nbUnverified);
     }
+    elites.offer(assign, nbUnverified);
+}
+
+template<class S>
+bool MCTSInstance<S>::finished() const {
+    return best.score.load(memory_order_relaxed) <= settings.target
+        || (sharedBest != nullptr && sharedBest->score.load(memory_order_relaxed) <= settings.target);
 }
 
 
@@ -260,178 +1066,561 @@ Assignment applyAction(const Assignment& assign, Literal action) {
     return nextAssign;
 }
 
-template<class S>
-Assignment applyFlipAlgorithm(MCTSInstance<S>& inst, const Assignment& assign, int nbUnassigned) {
-    Assignment nextAssign;
-    int flipBudget = inst.pb.nVars * inst.settings.walkBudgetPerVar; // TODO: unassigned or total?
-
-    if (inst.settings.flipAlgorithm == "novelty") {
-        nextAssign = applyWalkSat(inst.pb, assign, flipBudget, inst.settings.walkEps, true);
-    } else if (inst.settings.flipAlgorithm == "walksat") {
-        nextAssign = applyWalkSat(inst.pb, assign, flipBudget, inst.settings.walkEps, false);
-    } else {
-        assert((false));
-    }
-    return nextAssign;
-}
-
+// Prevents a node from being evicted while a search is using it. Adopts the pin of playPinned with adopt_lock.
+struct NodePin {
+    MCState* state;
+    NodePin(MCState* _state) : state(_state) { atomic_ref<int>(state->pinned)++; }
+    NodePin(MCState* _state, adopt_lock_t) : state(_state) {}
+    NodePin(const NodePin&) = delete;
+    NodePin& operator=(const NodePin&) = delete;
+    ~NodePin() { atomic_ref<int>(state->pinned)--; }
+};
 
 void runRollout(MCTSInstance<>& inst) {
     auto assign = inst.pb.freeAssignment();
     int steps = inst.settings.steps;
-    for (int iStep = 0; iStep < steps; iStep++) {
+    if (inst.settings.nThreads > 1) { // Independent rollouts, each one with its own random stream
+        MCState* state = inst.get(assign);
+        parallelFor(steps, [&](int iStep) {
+            if (!inst.finished()) {
+                seedRandom(streamSeed(inst.settings.seed, iStep));
+                state->rolloutValue(inst);
+            }
+        });
+        return;
+    }
+    for (int iStep = 0; iStep < steps && !inst.finished(); iStep++) {
         MCState* state = inst.get(assign);
         state->rolloutValue(inst);
     }
 }
 
-int MCTSearchDfs(MCTSInstance<>& inst, Assignment& assign) {
-    MCState* state = inst.get(assign);
-    state->nbTimesSeen += 1;
-    // cerr << "Assign " << assign << " x" << state->nbTimesSeen << endl;
+using MCTSStack = vector<pair<MCState*, int>>; // (state, actionId) for each edge of the descent
 
-    if (state->terminal || state->nbTimesSeen == 1) {
-        return state->rolloutValue(inst);
+int MCTSearch(MCTSInstance<>& inst, MCState* state, SearchPath& path, MCTSStack& stack) {
+    int startDepth = path.depth();
+    stack.clear();
+
+    // Selection and expansion, until reaching a new or terminal node
+    while (true) {
+        state->nbTimesSeen += 1;
+        // cerr << "Assign " << state->stateAssign << " x" << state->nbTimesSeen << endl;
+        if (state->terminal || state->nbTimesSeen == 1) {
+            break;
+        }
+        int actionId = state->getUCBActionId(inst);
+        // cerr << "Take action " << state->nextActions[actionId] << endl;
+        stack.push_back({state, actionId});
+        state = state->play(inst, path, actionId);
+    }
+
+    // Simulation
+    int score = state->rolloutValue(inst);
+
+    // Backpropagation
+    for (int iEdge = (int)stack.size() - 1; iEdge >= 0; iEdge--) {
+        stack[iEdge].first->updateAfterActionId(inst, stack[iEdge].second, score);
+    }
+    path.undoTo(startDepth);
+    return score;
+}
+
+int MCTSearchShared(MCTSInstance<>& inst, MCState* state, SearchPath& path, MCTSStack& stack) {
+    /* Same as MCTSearch, for threads descending the same tree: statistics are read and written atomically,
+    without locks, and virtual losses are added on the way down so that the threads spread out.
+    The nodes below the state are pinned until the end of the step, as other threads may evict nodes. */
+    int virtualLoss = inst.settings.virtualLoss;
+    int startDepth = path.depth();
+    stack.clear();
+
+    // Selection and expansion, until reaching a new or terminal node
+    while (true) {
+        int nbTimesSeen = atomic_ref<int>(state->nbTimesSeen).fetch_add(1, memory_order_relaxed) + 1;
+        if (state->terminal || nbTimesSeen == 1) {
+            break;
+        }
+        int actionId = state->getUCBActionId(inst);
+        atomic_ref<int>(state->actionsVirtualLoss[actionId]).fetch_add(virtualLoss, memory_order_relaxed);
+        atomic_ref<int>(state->nbVirtualLoss).fetch_add(virtualLoss, memory_order_relaxed);
+        stack.push_back({state, actionId});
+        state = state->playPinned(inst, path, actionId);
+    }
+
+    // Simulation
+    int score = state->rolloutValue(inst);
+
+    // Backpropagation, removing the virtual losses
+    for (int iEdge = (int)stack.size() - 1; iEdge >= 0; iEdge--) {
+        auto [edgeState, actionId] = stack[iEdge];
+        edgeState->updateAfterActionId(inst, actionId, score);
+        atomic_ref<int>(edgeState->actionsVirtualLoss[actionId]).fetch_sub(virtualLoss, memory_order_relaxed);
+        atomic_ref<int>(edgeState->nbVirtualLoss).fetch_sub(virtualLoss, memory_order_relaxed);
+    }
+    for (int iEdge = 1; iEdge < (int)stack.size(); iEdge++) {
+        atomic_ref<int>(stack[iEdge].first->pinned)--;
+    }
+    if (!stack.empty()) {
+        atomic_ref<int>(state->pinned)--;
     }
-    Literal action = state->getUCBAction(inst);
-    // cerr << "Take action " << action << endl;
-    auto nextAssign = applyAction(assign, action);
-    int score = MCTSearchDfs(inst, nextAssign);
-    state->updateAfterAction(inst, action, score);
+    path.undoTo(startDepth);
     return score;
 }
 
+void runMCTSRootParallel(MCTSInstance<>& inst);
+void runMCTSTreeParallel(MCTSInstance<>& inst);
+
 void runMCTS(MCTSInstance<>& inst) {
+    if (inst.settings.nThreads > 1 && inst.settings.parallel == ParallelMode::Root) {
+        return runMCTSRootParallel(inst);
+    } else if (inst.settings.nThreads > 1 && inst.settings.parallel == ParallelMode::Tree) {
+        return runMCTSTreeParallel(inst);
+    }
     int steps = inst.settings.steps;
-    auto assign = inst.pb.freeAssignment();
-    bool discounted = (inst.settings.behavior == "discounted");
-    bool once = (inst.settings.behavior == "once");
+    SearchPath path(inst.pb, inst.settings.tracksClauses());
+    MCTSStack stack;
+    bool discounted = (inst.settings.behavior == Behavior::Discounted);
+    bool once = (inst.settings.behavior == Behavior::Once);
 
-    MCState* state = inst.get(assign);
-    while (!state->terminal) {
+    MCState* state = inst.get(path);
+    while (!state->terminal && !inst.finished()) {
         // Compute number of steps to do if a discount is applied
         int nbPrevSteps = discounted ? state->nbTimesSeen : 0;
-        for (int iStep = nbPrevSteps; iStep < steps; iStep++) {
-            MCTSearchDfs(inst, assign);
+        {
+            NodePin pinRoot(state);
+            for (int iStep = nbPrevSteps; iStep < steps && !inst.finished(); iStep++) {
+                MCTSearch(inst, state, path, stack);
+                inst.limitTreeMemory();
+            }
         }
         if (once) {
             break;
         }
-        // Take action
-        Literal action = state->getUCBAction(inst, false); // No exploration
-        assign = applyAction(assign, action);
-        state = inst.get(assign);
+        // Take action, and only keep the nodes below the chosen child
+        int actionId = state->getUCBActionId(inst, false); // No exploration
+        state = inst.reroot(state->play(inst, path, actionId), state->nextActions[actionId]);
+    }
+}
+
+MCState* commitAction(MCTSInstance<>& inst, MCState* state, SearchPath& path, const Literal& action) {
+    /* Play an action which may not be in the next actions of the state, and only keep the nodes below it */
+    MCState* nextState = nullptr;
+    for (int iAction = 0; iAction < (int)state->nextActions.size(); iAction++) {
+        if (state->nextActions[iAction] == action) {
+            nextState = state->play(inst, path, iAction);
+        }
+    }
+    if (nextState == nullptr) {
+        path.set(action);
+        nextState = inst.get(path);
+    }
+    return inst.reroot(nextState, action);
+}
+
+void runMCTSRootParallel(MCTSInstance<>& inst) {
+    /* Each thread grows its own tree from the same root with its own random stream.
+    Root statistics and best assignments are merged every syncSteps steps and before each decision,
+    and all the trees then commit the same action. The rounds between merges are tasks of the scheduler,
+    so each tree keeps its random generator from one round to the next. The trees share the memory budget. */
+    int nThreads = inst.settings.nThreads;
+    int steps = inst.settings.steps;
+    int syncSteps = inst.settings.syncSteps > 0 ? inst.settings.syncSteps : steps;
+    int nbRounds = max(1, (steps + syncSteps - 1) / syncSteps);
+    bool discounted = (inst.settings.behavior == Behavior::Discounted);
+    bool once = (inst.settings.behavior == Behavior::Once);
+
+    BestSolution best(inst.pb.nVars);
+    BestSolution* prevSharedBest = inst.sharedBest; // Restored at the end, it gets the best of all the trees
+    size_t prevMemoryLimit = inst.treeMemoryLimit;
+    vector<unique_ptr<MCTSInstance<>>> threadInsts;
+    vector<MCTSInstance<>*> insts{&inst};
+    for (int iThread = 1; iThread < nThreads; iThread++) {
+        threadInsts.emplace_back(new MCTSInstance<>{inst.settings, inst.pb});
+        insts.push_back(threadInsts.back().get());
+    }
+    for (MCTSInstance<>* tInst : insts) {
+        tInst->treeMemoryLimit = prevMemoryLimit / nThreads;
+    }
+    vector<mt19937> generators(nThreads);
+    vector<SearchPath> paths;
+    vector<MCTSStack> stacks(nThreads);
+    vector<MCState*> roots(nThreads, nullptr);
+    for (int iThread = 0; iThread < nThreads; iThread++) {
+        insts[iThread]->sharedBest = &best;
+        generators[iThread].seed(streamSeed(inst.settings.seed, iThread));
+        paths.emplace_back(inst.pb, inst.settings.tracksClauses());
+        roots[iThread] = insts[iThread]->get(paths[iThread]);
+    }
+
+    // Merged statistics of the root actions, by literal id: all roots hold them after a merge
+    vector<int> mergedN(2 * inst.pb.nVars, 0);
+    vector<double> mergedValues(2 * inst.pb.nVars, 0);
+
+    auto mergeRoots = [&](bool freshRoots) {
+        vector<int> nextN = freshRoots ? vector<int>(mergedN.size(), 0) : mergedN;
+        vector<double> nextValues = freshRoots ? vector<double>(mergedValues.size(), 0) : mergedValues;
+        for (MCState* root : roots) { // Add what each thread did since the last merge
+            for (int iAction = 0; iAction < (int)root->nextActions.size(); iAction++) {
+                int litId = root->nextActions[iAction].id(inst.pb);
+                int prevN = freshRoots ? 0 : mergedN[litId];
+                double prevValues = freshRoots ? 0 : mergedValues[litId];
+                nextN[litId] += root->actionsNExplorations[iAction] - prevN;
+                nextValues[litId] += root->actionsNExplorations[iAction] * root->actionsQValues[iAction] - prevValues;
+            }
+        }
+        mergedN = nextN;
+        mergedValues = nextValues;
+        for (MCState* root : roots) {
+            root->nbSubExplorations = 0;
+            for (int iAction = 0; iAction < (int)root->nextActions.size(); iAction++) {
+                int litId = root->nextActions[iAction].id(inst.pb);
+                root->actionsNExplorations[iAction] = mergedN[litId];
+                if (mergedN[litId]) {
+                    root->actionsQValues[iAction] = mergedValues[litId] / mergedN[litId];
+                }
+                root->nbSubExplorations += mergedN[litId];
+            }
+        }
+        Assignment bestAssign;
+        int bestScore = best.read(bestAssign);
+        for (MCTSInstance<>* tInst : insts) {
+            tInst->updateBest(bestAssign, bestScore);
+        }
+    };
+
+    while (!roots[0]->terminal && !inst.finished()) { // All the trees have the same root, so they stop together
+        // Compute number of steps to do if a discount is applied
+        vector<int> nbPrevSteps(nThreads);
+        for (int iThread = 0; iThread < nThreads; iThread++) {
+            nbPrevSteps[iThread] = discounted ? roots[iThread]->nbTimesSeen : 0;
+        }
+        for (int iSync = 0; iSync < nbRounds; iSync++) {
+            int endStep = min(steps, (iSync + 1) * syncSteps);
+            parallelFor(nThreads, [&](int iThread) {
+                MCTSInstance<>& tInst = *insts[iThread];
+                NodePin pinRoot(roots[iThread]);
+                randomGenerator() = generators[iThread];
+                int iStep = max(nbPrevSteps[iThread], iSync * syncSteps);
+                for (; iStep < endStep && !tInst.finished(); iStep++) {
+                    MCTSearch(tInst, roots[iThread], paths[iThread], stacks[iThread]);
+                    tInst.limitTreeMemory();
+                }
+                generators[iThread] = randomGenerator();
+            });
+            mergeRoots(iSync == 0);
+        }
+        if (once) {
+            break;
+        }
+
+        // Decide with the merged values, without exploration
+        Literal decision{-1, false};
+        double bestValue = -1;
+        for (MCState* root : roots) {
+            for (int iAction = 0; iAction < (int)root->nextActions.size(); iAction++) {
+                if (root->actionsQValues[iAction] > bestValue) {
+                    bestValue = root->actionsQValues[iAction];
+                    decision = root->nextActions[iAction];
+                }
+            }
+        }
+        parallelFor(nThreads, [&](int iThread) {
+            roots[iThread] = commitAction(*insts[iThread], roots[iThread], paths[iThread], decision);
+        });
+    }
+
+    for (MCTSInstance<>* tInst : insts) {
+        tInst->sharedBest = nullptr;
     }
+    inst.sharedBest = prevSharedBest;
+    inst.treeMemoryLimit = prevMemoryLimit;
+    Assignment bestAssign;
+    int bestScore = best.read(bestAssign);
+    inst.updateBest(bestAssign, bestScore);
 }
 
-int NMCS(MCTSInstance<>& inst, Assignment assign, int level) {
-    MCState* state = inst.get(assign);
+void runMCTSTreeParallel(MCTSInstance<>& inst) {
+    /* All the threads descend the same tree. The steps of a decision are run by rounds of syncSteps.
+    Each thread limits the tree memory after its steps, while the other ones search. */
+    int nThreads = inst.settings.nThreads;
+    int steps = inst.settings.steps;
+    int syncSteps = inst.settings.syncSteps > 0 ? inst.settings.syncSteps : steps;
+    SearchPath rootPath(inst.pb, inst.settings.tracksClauses());
+    bool discounted = (inst.settings.behavior == Behavior::Discounted);
+    bool once = (inst.settings.behavior == Behavior::Once);
+    int iStream = 0;
+
+    MCState* state = inst.get(rootPath);
+    while (!state->terminal && !inst.finished()) {
+        // Compute number of steps to do if a discount is applied
+        int nbPrevSteps = discounted ? state->nbTimesSeen : 0;
+        {
+            NodePin pinRoot(state);
+            for (int roundStart = nbPrevSteps; roundStart < steps; roundStart += syncSteps) {
+                atomic<int> nbStepsLeft(min(syncSteps, steps - roundStart));
+                parallelFor(nThreads, [&](int iThread) {
+                    seedRandom(streamSeed(inst.settings.seed, iStream + iThread));
+                    SearchPath path = rootPath;
+                    MCTSStack stack;
+                    while (nbStepsLeft.fetch_sub(1) > 0 && !inst.finished()) {
+                        MCTSearchShared(inst, state, path, stack);
+                        inst.limitTreeMemory();
+                    }
+                });
+                iStream += nThreads;
+            }
+        }
+        if (once) {
+            break;
+        }
+        // Take action, and only keep the nodes below the chosen child
+        int actionId = state->getUCBActionId(inst, false); // No exploration
+        state = inst.reroot(state->play(inst, rootPath, actionId), state->nextActions[actionId]);
+    }
+}
+
+void runTasksInParallel(MCTSInstance<>& inst, const SearchPath& path, int nTasks, uint64_t streamBase,
+        const function<void(int, SearchPath&)>& task) {
+    /* Run task(0), ..., task(nTasks-1) on the scheduler. Each task has its own random stream and copy of the path.
+    The tasks may evict nodes: they should only use the pinned ones. */
+    parallelFor(nTasks, [&](int iTask) {
+        SearchPath taskPath = path;
+        seedRandom(streamSeed(inst.settings.seed, streamBase * nTasks + iTask));
+        task(iTask, taskPath);
+    });
+}
+
+int NMCS(MCTSInstance<>& inst, MCState* state, SearchPath& path, int level, int parallelDepth) {
+    /* The actions of the top parallelDepth levels are evaluated in parallel. The state should be pinned by the caller. */
     if (state->terminal || level <= 0) {
         return state->rolloutValue(inst);
     }
+    bool parallel = (parallelDepth > 0 && inst.settings.nThreads > 1);
+    int startDepth = path.depth();
     int bestSeqScore = INF;
-    while (!state->terminal) {
-        int bestActionScore = INF;
-        Assignment bestNextAssign;
-        for (Literal action : state->nextActions) {
-            Assignment nextAssign = applyAction(assign, action);
-            int actionScore = NMCS(inst, nextAssign, level-1);
-            if (actionScore < bestActionScore) {
-                bestActionScore = actionScore;
-                bestNextAssign = nextAssign;
+    vector<int> actionScores;
+    optional<NodePin> pinState; // For the states after the first one
+    while (!state->terminal && !inst.finished()) {
+        inst.limitTreeMemory();
+        int nActions = state->nextActions.size();
+        actionScores.resize(nActions);
+        auto evalAction = [&](int iAction, SearchPath& actionPath) {
+            NodePin pinChild(state->playPinned(inst, actionPath, iAction), adopt_lock);
+            actionScores[iAction] = NMCS(inst, pinChild.state, actionPath, level-1, parallelDepth-1);
+            actionPath.undo();
+        };
+        if (parallel) {
+            runTasksInParallel(inst, path, nActions, randInt(), evalAction);
+        } else {
+            for (int iAction = 0; iAction < nActions; iAction++) {
+                evalAction(iAction, path);
             }
         }
-        assign = bestNextAssign;
-        bestSeqScore = min(bestSeqScore, bestActionScore);
-        state = inst.get(assign);
+
+        int bestActionId = min_element(begin(actionScores), end(actionScores)) - begin(actionScores);
+        bestSeqScore = min(bestSeqScore, actionScores[bestActionId]);
+        state = state->playPinned(inst, path, bestActionId);
+        pinState.emplace(state, adopt_lock);
     }
+    path.undoTo(startDepth); // Give back the path as it was received
     return bestSeqScore;
 }
 
 void runNMCS(MCTSInstance<>& inst) {
-    for (int step = 0; step < inst.settings.steps; step++) {
-        NMCS(inst, inst.pb.freeAssignment(), inst.settings.nmcsDepth);
+    /* With several threads, the repetitions are also run in parallel */
+    SearchPath path(inst.pb, inst.settings.tracksClauses());
+    MCState* root = inst.get(path);
+    NodePin pinRoot(root);
+    int steps = inst.settings.steps;
+    if (inst.settings.nThreads > 1 && steps > 1) {
+        runTasksInParallel(inst, path, steps, 0, [&](int, SearchPath& stepPath) {
+            if (inst.finished()) {
+                return;
+            }
+            NMCS(inst, root, stepPath, inst.settings.nmcsDepth, inst.settings.parallelDepth);
+        });
+    } else {
+        for (int step = 0; step < steps && !inst.finished(); step++) {
+            NMCS(inst, root, path, inst.settings.nmcsDepth, inst.settings.parallelDepth);
+        }
     }
 }
 
-int seqHalving(MCTSInstance<>& inst, Assignment assign, int budget) { 
-    MCState* state = inst.get(assign);
+int seqHalving(MCTSInstance<>& inst, MCState* state, SearchPath& path, int budget, int parallelDepth) {
+    /* The moves of each round are evaluated in parallel in the top parallelDepth levels. Node statistics
+    are then updated atomically, as other threads may reach the same node by transposition.
+    The state should be pinned by the caller. */
+    if (inst.finished()) {
+        return INF;
+    }
+    inst.limitTreeMemory();
     int bestScore = INF;
 
     // If no budget or terminal, use all the remaining budget on rollouts
     // if (state->terminal || budget <= 1) {
     if (state->terminal || budget < state->nextActions.size()) {
         // for (int step = 0; step < max(budget, 1); step++) {
-        for (int step = 0; step < budget; step++) {
+        for (int step = 0; step < budget && !inst.finished(); step++) {
             bestScore = min(bestScore, state->rolloutValue(inst));
         }
         return bestScore;
     }
-    state->nbTimesSeen += budget;
     
     // Else, split the budget between runs
     vector<pair<double, int>> movesScores;
+    atomic_ref<int>(state->nbTimesSeen).fetch_add(budget, memory_order_relaxed);
     for (int iAction = 0; iAction < (int)state->nextActions.size(); iAction++) {
-        movesScores.push_back({state->bestScoresForActions[iAction], iAction});
+        movesScores.push_back({atomic_ref<int>(state->bestScoresForActions[iAction]).load(memory_order_relaxed), iAction});
     }
     sort(rbegin(movesScores), rend(movesScores)); // Sort in reverse order to evaluate unseen moves first
+
+    bool parallel = (parallelDepth > 0 && inst.settings.nThreads > 1);
+    int iRound = 0;
     while (movesScores.size() > 1) {
-        int loopBudget = budget / ceil(log2(movesScores.size()) + 1);
+        int nMoves = movesScores.size();
+        int loopBudget = budget / ceil(log2(nMoves) + 1);
         budget -= loopBudget;
-        for (int iMove = 0; iMove < (int)movesScores.size(); iMove++) {
-            int callBudget = loopBudget / (movesScores.size() - iMove);
-            loopBudget -= callBudget;
+        vector<int> callBudgets(nMoves), callScores(nMoves);
+        for (int iMove = 0; iMove < nMoves; iMove++) {
+            callBudgets[iMove] = loopBudget / (nMoves - iMove);
+            loopBudget -= callBudgets[iMove];
+        }
 
+        auto evalMove = [&](int iMove, SearchPath& movePath) {
             int iAction = movesScores[iMove].second;
-            state->actionsNExplorations[iAction] += callBudget;
+            int callBudget = callBudgets[iMove];
+            atomic_ref<int>(state->actionsNExplorations[iAction]).fetch_add(callBudget, memory_order_relaxed);
             const Literal& action = state->nextActions[iAction];
-            auto callAssign = applyAction(assign, action);
-            int callScore = seqHalving(inst, callAssign, callBudget);
+            NodePin pinChild(state->playPinned(inst, movePath, iAction), adopt_lock);
+            int callScore = seqHalving(inst, pinChild.state, movePath, callBudget, parallelDepth-1);
+            movePath.undo();
             
             // Update best scores
-            int actionBestScore = min(callScore, state->bestScoresForActions[iAction]);
+            atomic_ref<int> bestScoreRef(state->bestScoresForActions[iAction]);
+            int actionBestScore = bestScoreRef.load(memory_order_relaxed);
+            while (callScore < actionBestScore
+                    && !bestScoreRef.compare_exchange_weak(actionBestScore, callScore, memory_order_relaxed)) {
+            }
+            actionBestScore = min(actionBestScore, callScore);
+            int actionNExplorations = atomic_ref<int>(state->actionsNExplorations[iAction]).load(memory_order_relaxed);
             // double amafScore = actionBestScore + inst.settings.amaf * inst.amafGet(action, inst.get(assign)->nbTimesSeen);
-            double amafScore = inst.amafGet(action, actionBestScore, state->actionsNExplorations[iAction]);
+            double amafScore = inst.amafGet(action, actionBestScore, actionNExplorations);
             inst.amafAddResult(action, callScore, callBudget);
             movesScores[iMove].first = amafScore;
-            state->bestScoresForActions[iAction] = actionBestScore;
+            callScores[iMove] = callScore;
+        };
+
+        if (parallel) {
+            runTasksInParallel(inst, path, nMoves, (uint64_t)path.hash * 64 + iRound, evalMove);
+        } else {
+            for (int iMove = 0; iMove < nMoves; iMove++) {
+                evalMove(iMove, path);
+            }
+        }
+        for (int callScore : callScores) {
             bestScore = min(bestScore, callScore);
         }
+
         sort(begin(movesScores), end(movesScores));
         int nKeep = movesScores.size()/2;
         while (movesScores.size() > nKeep) {
             movesScores.pop_back();
         }
+        iRound++;
+    }
+    int bestActionId = movesScores[0].second;
+    atomic_ref<int>(state->bestActionId).store(bestActionId, memory_order_relaxed);
+    // The remaining budget continues the same sequence, at the same parallel level
+    {
+        NodePin pinChild(state->playPinned(inst, path, bestActionId), adopt_lock);
+        bestScore = min(bestScore, seqHalving(inst, pinChild.state, path, budget, parallelDepth));
     }
-    auto nextAssign = applyAction(assign, state->nextActions[movesScores[0].second]);
-    state->bestActionId = movesScores[0].second;
-    bestScore = min(bestScore, seqHalving(inst,nextAssign, budget));
+    path.undo();
     return bestScore;
 }
 
 void runSeqHalving(MCTSInstance<>& inst) {
     int budget = inst.settings.steps;
-    auto assign = inst.pb.freeAssignment();
-    bool discounted = (inst.settings.behavior == "discounted");
-    bool once = (inst.settings.behavior == "once");
+    SearchPath path(inst.pb, inst.settings.tracksClauses());
+    bool discounted = (inst.settings.behavior == Behavior::Discounted);
+    bool once = (inst.settings.behavior == Behavior::Once);
 
-    MCState* state = inst.get(assign);
-    while (!state->terminal) {
+    MCState* state = inst.get(path);
+    while (!state->terminal && !inst.finished()) {
         // Compute number of steps to do if a discount is applied
         int discount = discounted ? state->nbTimesSeen : 0;
-        seqHalving(inst, assign, budget - discount);
+        {
+            NodePin pinRoot(state);
+            seqHalving(inst, state, path, budget - discount, inst.settings.parallelDepth);
+        }
 
         if (once) {
             break;
         }
         // Take action
         assert((state->bestActionId >= 0));
-        Literal action = state->nextActions[state->bestActionId];
-        assign = applyAction(assign, action);
-        state = inst.get(assign);
+        state = inst.reroot(state->play(inst, path, state->bestActionId), state->nextActions[state->bestActionId]);
+    }
+}
+
+void runMethod(MCTSInstance<>& inst, const string& method) {
+    if (method == "rollout") {
+        runRollout(inst);
+    } else if (method == "mcts") {
+        runMCTS(inst);
+    } else if (method == "nested_mc") {
+        runNMCS(inst);
+    } else if (method == "seq_halving") {
+        runSeqHalving(inst);
     }
 }
 
+
+/*
+    Portfolio
+*/
+
+vector<pair<string, MCSettings>> portfolioVariants(const MCSettings& base, const string& method) {
+    /* Configurations which do well on different datasets. The steps, the behavior and the other settings are
+    those given, so that each variant takes about the time of the configuration given. */
+    vector<pair<string, MCSettings>> variants(7, {method, base});
+    variants[1].first = "seq_halving";
+    variants[1].second.amaf = 0.5;
+    variants[2].first = "rollout";
+    variants[2].second.walkEps = 0.5;
+    variants[3].first = "mcts";
+    variants[4].first = "rollout";
+    variants[4].second.flipAlgorithm = FlipAlgorithm::Novelty;
+    variants[5].first = "nested_mc";
+    variants[6].first = "seq_halving";
+    variants[6].second.rolloutHeuristic = 1;
+    return variants;
+}
+
+void runPortfolio(MCTSInstance<>& inst, const string& method) {
+    /* One variant per thread, the first one is the configuration given. Each variant runs single-threaded
+    on its own instance, all of them share the best assignment of inst, and stop once it reaches the target. */
+    int nVariants = max(1, inst.settings.nThreads);
+    auto variants = portfolioVariants(inst.settings, method);
+    vector<unique_ptr<MCTSInstance<>>> variantInsts;
+    for (int iVariant = 0; iVariant < nVariants; iVariant++) {
+        MCSettings settings = variants[iVariant % variants.size()].second;
+        settings.nThreads = 1;
+        if (iVariant > 0) {
+            settings.seed = streamSeed(settings.seed, iVariant);
+        }
+        variantInsts.emplace_back(new MCTSInstance<>{settings, inst.pb});
+        variantInsts.back()->treeMemoryLimit = inst.treeMemoryLimit / nVariants;
+        variantInsts.back()->sharedBest = &inst.best;
+    }
+
+    parallelFor(nVariants, [&](int iVariant) {
+        MCTSInstance<>& variantInst = *variantInsts[iVariant];
+        seedRandom(variantInst.settings.seed);
+        runMethod(variantInst, variants[iVariant % variants.size()].first);
+    });
+}
+
+
 /*
     Template instantiation
 */
@@ -2,9 +2,13 @@
 #define MC_HPP
 
 #include <vector>
+#include <array>
 #include <unordered_map>
 #include <memory>
 #include <string>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
 
 #include "maxsat.hpp"
 #include "util.hpp"
@@ -12,19 +16,31 @@
 const uint HASH_MOD = 1e9+7;
 
 struct MCState;
+struct SearchPath;
 template<class S=MCState> struct MCTSInstance;
 
 /*
     Settings
 */
 
+// Policies, chosen once from the settings (same order as their names on the command line)
+enum class Heuristic { Random, H1Static, H2Static, H3Static, H1Dynamic, H2Dynamic, H3Dynamic, Marginals, PhaseSaving };
+enum class FlipAlgorithm { WalkSat, Novelty };
+enum class Behavior { Once, Full, Discounted };
+enum class ParallelMode { Root, Tree };
+enum class LeafReduce { Min, Mean };
+
 struct MCSettings {
     int seed;
     int nodeNActionVars; // 0 for all variables, or > 0 for the number of vars
-    int nodeActionVarsHeuristic; // 0 for random, or i in [1, 2, 3] for Hi
+    int nodeActionVarsHeuristic; // 0 for random, i in [1, 2, 3] for Hi, 4 for the lookahead, or 5 for the marginals
     bool nodeActionHeuristicDynamic;
-    int rolloutHeuristic; // 0 for random, or i in [1, 2, 3] for Hi
+    int rolloutHeuristic; // 0 for random, i in [1, 2, 3] for Hi, 5 for the marginals, or 6 for phase saving
     bool dynamicHeuristic;
+    bool rolloutPropagation; // Unit propagation after each assignment of the rollout heuristic
+    int phasePool; // Number of best assignments the phase saving heuristic starts from
+    double phaseEps; // Probability for each phase to be replaced by a random value
+    int rolloutCache; // 0 for none, 1 to cache the heuristic completion of each node, 2 with its clause counts
     int walkBudgetPerVar;
     double walkEps;
     double ucbCExplo;
@@ -32,10 +48,23 @@ struct MCSettings {
     double amafBias;
     int steps;
     int nmcsDepth;
-    std::string behavior;
-    std::string flipAlgorithm; // walksat, novelty
+    Behavior behavior;
+    FlipAlgorithm flipAlgorithm;
+    int treeMemoryMB; // 0 for no limit, or memory budget of the tree before evicting nodes
+    int nThreads;
+    ParallelMode parallel;
+    int virtualLoss; // Losses added to an action while a parallel descent goes through it (tree parallel)
+    int leafRollouts; // Rollouts evaluated in parallel each time a node is rolled out
+    LeafReduce leafReduce; // How these rollouts are combined
+    int parallelDepth; // Number of top levels of SH and NMCS whose moves are evaluated in parallel
+    int syncSteps; // Steps between merges of parallel searches (0 to only merge before a decision)
+    int target; // Searches stop once an assignment with at most this score is found
 
     MCSettings();
+    Heuristic rolloutPolicy() const;
+    bool usesMarginals() const;
+    bool cachesCompletions() const; // Only for the deterministic heuristics
+    bool tracksClauses() const; // Whether the search paths keep the clause counters, for the node heuristics
 };
 
 
@@ -43,53 +72,264 @@ struct MCSettings {
     MC Tree
 */
 
+const int COMPLETION_EMPTY = 0, COMPLETION_STORING = 1, COMPLETION_STORED = 2;
+
+// When threads share a tree, the statistics and children of its nodes are read and updated through atomic_ref,
+// so that the nodes stay movable
 struct MCState {
     Assignment stateAssign;
     int nbTimesSeen;
     int nbUnassigned;
     bool terminal;
     int bestActionId;
+    uint64_t lastUsed; // Instance clock at the last visit, for eviction
+    int pinned; // Number of searches currently using this node, which can't be evicted (through atomic_ref)
 
     std::vector<Literal> nextActions;
     int nbSubExplorations;
     std::vector<int> actionsNExplorations;
     std::vector<double> actionsQValues;
     std::vector<int> bestScoresForActions;
+    std::vector<MCState*> children; // Resolved through the tree on first use, nullptr before
+    std::vector<int> actionsVirtualLoss; // Pending parallel descents through each action
+    int nbVirtualLoss;
 
+    // Rollout heuristic completion of the state, stored by the first rollout (empty before), which adds its memory
+    // to the tree
+    Assignment completion;
+    std::vector<int> completionNbTrue; // Number of true literals of each clause in the completion
+    long long completionConflicts;
+    int completionState; // COMPLETION_EMPTY, COMPLETION_STORING or COMPLETION_STORED
 
-    MCState(MCSettings&, SatProblem&, Assignment&);
+
+    MCState(const MCSettings&, const SatProblem&, const Assignment&, const SearchPath* path = nullptr);
     int getActionId(const Literal&);
+    std::size_t memoryUsage() const;
+    template<class S> S* play(MCTSInstance<S>&, SearchPath&, int actionId);
+    template<class S> S* playPinned(MCTSInstance<S>&, SearchPath&, int actionId); // The caller unpins the child
     template<class S> int rolloutValue(MCTSInstance<S>&);
+    // In a batch, the elites are a snapshot of the pool, and the assignment is given back instead of updating the best
+    template<class S> int rolloutOnce(MCTSInstance<S>&, const std::vector<Assignment>* elites = nullptr,
+        Assignment* outAssign = nullptr);
+    template<class S> void fillCompletion(MCTSInstance<S>&);
+    template<class S> int getUCBActionId(MCTSInstance<S>&, bool allowExploration=true);
     template<class S> Literal getUCBAction(MCTSInstance<S>&, bool allowExploration=true);
     template<class S> void updateAfterAction(MCTSInstance<S>&, Literal, int);
+    template<class S> void updateAfterActionId(MCTSInstance<S>&, int actionId, int score);
 };
 
 struct AssignmentHash {
+    using is_transparent = void;
     std::size_t operator()(const Assignment& assign) const;
+    std::size_t operator()(const SearchPath& path) const;
+};
+
+struct AssignmentEqual {
+    using is_transparent = void;
+    bool operator()(const Assignment&, const Assignment&) const;
+    bool operator()(const Assignment&, const SearchPath&) const;
+    bool operator()(const SearchPath&, const Assignment&) const;
+};
+
+// Transposition table, split in shards by hash: threads looking up nodes of different shards don't wait for each other
+template<class T=MCState>
+struct MCTree {
+    static const int N_SHARDS = 64;
+    using Nodes = std::unordered_map<Assignment, T*, AssignmentHash, AssignmentEqual>;
+    struct Shard {
+        Nodes nodes;
+        std::shared_mutex lock; // Shared by the lookups, exclusive for the insertions
+    };
+    std::array<Shard, N_SHARDS> shards;
+
+    Shard& shardOf(std::size_t hash) {
+        return shards[(hash * 0x9E3779B97F4A7C15ULL) >> 58]; // Top bits, the map buckets use the low ones
+    }
+    std::size_t size() const {
+        std::size_t nbNodes = 0;
+        for (const Shard& shard : shards) {
+            nbNodes += shard.nodes.size();
+        }
+        return nbNodes;
+    }
+    void swap(MCTree& other) {
+        for (int iShard = 0; iShard < N_SHARDS; iShard++) {
+            shards[iShard].nodes.swap(other.shards[iShard].nodes);
+        }
+    }
+    void insert(const Assignment& assign, T* node) {
+        shardOf(AssignmentHash{}(assign)).nodes.insert({assign, node});
+    }
+};
+
+// Storage of the tree nodes by chunks, which are all released at once with the arena
+template<class T>
+struct NodeArena {
+    static const int CHUNK_SIZE = 1024;
+    std::allocator<T> alloc;
+    std::vector<T*> chunks;
+    int nbUsedInChunk;
+    std::vector<T*> freeSlots; // Slots of destroyed nodes, reused first
+    std::mutex lock; // For the slots, as threads sharing a tree create nodes in parallel
+
+    NodeArena() : nbUsedInChunk(CHUNK_SIZE) {}
+    NodeArena(const NodeArena&) = delete;
+    NodeArena& operator=(const NodeArena&) = delete;
+    ~NodeArena() {
+        /* Nodes should be destroyed by the owner, only the storage is released here */
+        for (T* chunk : chunks) {
+            alloc.deallocate(chunk, CHUNK_SIZE);
+        }
+    }
+
+    template<class... Args> T* create(Args&&... args) {
+        T* slot;
+        lock.lock();
+        if (!freeSlots.empty()) {
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+        } else {
+            if (nbUsedInChunk == CHUNK_SIZE) {
+                chunks.push_back(alloc.allocate(CHUNK_SIZE));
+                nbUsedInChunk = 0;
+            }
+            slot = chunks.back() + (nbUsedInChunk++);
+        }
+        lock.unlock();
+        return new (slot) T(std::forward<Args>(args)...);
+    }
+
+    void swap(NodeArena& other) {
+        chunks.swap(other.chunks);
+        std::swap(nbUsedInChunk, other.nbUsedInChunk);
+        freeSlots.swap(other.freeSlots);
+    }
+
+    void destroy(T* node) {
+        node->~T();
+        lock.lock();
+        freeSlots.push_back(node);
+        lock.unlock();
+    }
+
+    std::size_t memoryUsage() const {
+        return chunks.size() * CHUNK_SIZE * sizeof(T);
+    }
 };
 
-template<class T=MCState> using MCTree = std::unordered_map<Assignment, std::unique_ptr<T>, AssignmentHash>;
+
+/*
+    Search path
+*/
+
+// Working assignment of a search thread, modified in place when going down and up the tree
+struct SearchPath {
+    const SatProblem* pb;
+    Assignment assign;
+    std::size_t hash; // Same value as AssignmentHash, updated incrementally
+    std::vector<int> trail; // Variables set on the path, in order
+    std::shared_ptr<const std::vector<uint>> hashWeights; // 3^(nVars-1-i) mod HASH_MOD, shared by copies
+    bool trackClauses; // The counters below are only kept when set, they are empty otherwise
+    std::vector<int> clsNbTrue, clsNbFalse; // Literals of each clause made true / false by the assignment
+    std::vector<std::array<int, 2>> nbTimesAsUnverified; // Occurrences of each literal in the clauses not verified yet
+
+    SearchPath(const SatProblem&, bool trackClauses = true); // Starts from the free assignment
+    int depth() const;
+    bool isVerified(int iCls) const;
+    bool isUnit(int iCls) const; // A single literal left to verify the clause
+    void set(const Literal&);
+    void undo();
+    void undoTo(int depth);
+};
 
 
 /*
     MC Instances
 */
 
+/* Best assignment found, updated by rollouts running in parallel without taking a lock.
+The score is claimed by a compare-and-swap, and the assignment is then published with a seqlock:
+readers copy it again if a writer changed it meanwhile. */
+struct BestSolution {
+    std::atomic<int> score; // Best score claimed
+    std::atomic<uint64_t> sequence; // Odd while a writer copies its assignment
+    int assignScore; // Score of the published assignment
+    Assignment assign; // Accessed through atomic_ref, its size never changes
+
+    BestSolution(int nVars);
+    bool update(const Assignment& newAssign, int newScore); // True if the score was improved
+    int read(Assignment& outAssign) const; // Copy of the published assignment, returns its score
+};
+
+/* Best distinct assignments found, in no particular order. Offers take a lock, as they are rare once the pool
+is full, and replace the worst elite. Picks run in each rollout, and read without a lock through a seqlock
+like BestSolution. */
+struct ElitePool {
+    int capacity;
+    std::atomic<int> worstScore; // Score to beat to enter the pool, INF while it is not full
+    std::atomic<uint64_t> sequence; // Odd while an offer changes an elite
+    std::atomic<int> nbElites;
+    std::vector<int> scores; // Only used by the offers
+    std::vector<Assignment> elites; // All allocated at creation, accessed through atomic_ref
+    std::mutex lock; // For the offers
+
+    ElitePool(int capacity, int nVars);
+    void offer(const Assignment& assign, int score);
+    bool pick(Assignment& outAssign) const; // Copy of an elite chosen at random, false if the pool is empty
+    void snapshot(std::vector<Assignment>& outElites) const; // Copy of all the elites
+};
+
+// Rollout from an assignment: completion by a heuristic, then a flip algorithm. Adds the conflicts of unit propagation.
+// The phases are the values of the phase saving heuristic, null for the other ones
+struct RolloutPolicy {
+    Assignment (*run)(const SatProblem&, const MCSettings&, const Assignment&, const Assignment* phases,
+        long long& nbConflicts);
+    // Both steps, for the rollouts from a cached completion
+    Assignment (*complete)(const SatProblem&, const Assignment&, const Assignment* phases, long long& nbConflicts);
+    Assignment (*flip)(const SatProblem&, const MCSettings&, const Assignment&, const std::vector<int>* clsNbTrue);
+};
+RolloutPolicy rolloutPolicyFor(const MCSettings&);
+
 template<class S>
 struct MCTSInstance {
     MCSettings settings;
-    SatProblem pb;
+    const SatProblem& pb; // Read only, can be shared between instances
+    RolloutPolicy rollout; // Specialized for the settings
+    NodeArena<S> arena;
     MCTree<S> tree;
+    std::atomic<uint64_t> clock;
+    std::atomic<uint64_t> nbRolloutBatches;
+    // Evictions run while other threads search, which only use pinned nodes. Getting a node and pinning it is
+    // a lookup: lookups wait for the eviction in progress, and the eviction for the lookups in progress.
+    std::atomic<int> nbLookups;
+    std::atomic<bool> evicting;
+    std::mutex evictionLock; // One eviction at a time
+    std::atomic<std::size_t> treeBytes, peakTreeBytes;
+    std::size_t treeMemoryLimit; // In bytes, 0 for no limit: the budget of the settings, or the share of it given to the instance
+    long long nbEvicted, nbReleased;
+    std::atomic<long long> nbConflicts; // Clauses falsified by unit propagation in the rollouts
 
-    int minUnverified;
-    Assignment bestAssignment;
+    BestSolution best;
+    BestSolution* sharedBest; // Also updated if not null
+    ElitePool elites; // Only filled for the phase saving heuristic
 
     std::vector<int> amafCount;
     std::vector<double> amafMin;
+    std::mutex amafLock;
 
     MCTSInstance(const MCSettings&, const SatProblem&);
+    ~MCTSInstance();
     S* get(Assignment&);
-    void updateBest(Assignment& assign, int nbUnverified = -1);
+    S* get(SearchPath&);
+    template<class Key> S* findOrCreate(const Key&, const Assignment&);
+    void touch(S*);
+    void beginLookup();
+    void endLookup();
+    void addTreeBytes(std::size_t nbBytes); // Also updates the peak
+    void limitTreeMemory();
+    S* reroot(S* root, const Literal& committed);
+    void updateBest(const Assignment& assign, int nbUnverified = -1);
+    bool finished() const; // The target was reached, by this instance or the shared best
 
     void amafAddResult(const Literal& action, double score, int count);
     double amafGet(const Literal& action, double realValue, int count);
@@ -101,13 +341,18 @@ struct MCTSInstance {
 */
 
 Assignment applyAction(const Assignment& assign, Literal action);
-template<class S>
-Assignment applyFlipAlgorithm(MCTSInstance<S>& inst, const Assignment& assign, int nbUnassigned);
-void runRollout(MCTSInstance<>& inst, int steps);
+template<Heuristic H, bool Propagate>
+Assignment applyHeuristic(const SatProblem& pb, const Assignment& assign, const Assignment* phases,
+    long long& nbConflicts);
+template<FlipAlgorithm F>
+Assignment applyFlipAlgorithm(const SatProblem& pb, const MCSettings& settings, const Assignment& assign,
+    const std::vector<int>* clsNbTrue);
 
 void runRollout(MCTSInstance<>& inst);
 void runMCTS(MCTSInstance<>& inst);
 void runNMCS(MCTSInstance<>& inst);
 void runSeqHalving(MCTSInstance<>& inst);
+void runMethod(MCTSInstance<>& inst, const std::string& method);
+void runPortfolio(MCTSInstance<>& inst, const std::string& method);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,166 @@
+#include "scheduler.hpp"
+#include "util.hpp"
+
+using namespace std;
+
+thread_local int workerId = -1; // -1 for the threads which are not workers
+
+const int JOIN_SPIN_ROUNDS = 8; // Checks doubled each round, before yielding
+const int JOIN_YIELD_ROUNDS = 16; // Yields before blocking
+
+static unique_ptr<Scheduler> globalScheduler = make_unique<Scheduler>(1);
+
+Scheduler& scheduler() {
+    return *globalScheduler;
+}
+
+void setNumThreads(int nThreads) {
+    if (nThreads != globalScheduler->nThreads()) {
+        globalScheduler.reset();
+        globalScheduler = make_unique<Scheduler>(nThreads);
+    }
+}
+
+/*
+    Scheduler
+*/
+
+Scheduler::Scheduler(int nThreads) : nbQueued(0), stopping(false), nbBlockedJoins(0) {
+    nThreads = max(1, nThreads);
+    for (int iQueue = 0; iQueue < nThreads; iQueue++) {
+        queues.emplace_back(new WorkerQueue);
+    }
+    for (int iWorker = 0; iWorker + 1 < nThreads; iWorker++) {
+        workers.emplace_back(&Scheduler::workerLoop, this, iWorker);
+    }
+}
+
+Scheduler::~Scheduler() {
+    {
+        lock_guard<mutex> guard(sleepLock);
+        stopping = true;
+    }
+    wakeUp.notify_all();
+    for (thread& worker : workers) {
+        worker.join();
+    }
+}
+
+int Scheduler::nThreads() const {
+    return queues.size();
+}
+
+void Scheduler::push(Task task) {
+    WorkerQueue& queue = *queues[workerId >= 0 ? workerId : queues.size() - 1];
+    {
+        lock_guard<mutex> guard(queue.lock);
+        queue.tasks.push_back(move(task));
+    }
+    nbQueued++;
+    {
+        lock_guard<mutex> guard(sleepLock); // A worker is either waiting, or will see nbQueued
+    }
+    wakeUp.notify_one();
+    if (nbBlockedJoins > 0) {
+        joinWakeUp.notify_all();
+    }
+}
+
+bool Scheduler::runOne() {
+    int nQueues = queues.size();
+    int ownQueue = workerId >= 0 ? workerId : nQueues - 1;
+    Task task;
+    bool found = false;
+    {
+        WorkerQueue& queue = *queues[ownQueue];
+        lock_guard<mutex> guard(queue.lock);
+        if (!queue.tasks.empty()) {
+            task = move(queue.tasks.back());
+            queue.tasks.pop_back();
+            found = true;
+        }
+    }
+    for (int iQueue = 1; iQueue < nQueues && !found; iQueue++) { // Steal the oldest task of another queue
+        WorkerQueue& queue = *queues[(ownQueue + iQueue) % nQueues];
+        lock_guard<mutex> guard(queue.lock);
+        if (!queue.tasks.empty()) {
+            task = move(queue.tasks.front());
+            queue.tasks.pop_front();
+            found = true;
+        }
+    }
+    if (!found) {
+        return false;
+    }
+    nbQueued--;
+
+    auto threadRandom = randomGenerator(); // Tasks may reseed, the thread keeps its own stream
+    task.fn();
+    randomGenerator() = threadRandom;
+    if (task.group->nbPending.fetch_sub(1) == 1 && nbBlockedJoins > 0) { // The group may be destroyed from here
+        {
+            lock_guard<mutex> guard(sleepLock); // The joining thread is either blocked, or will see nbPending
+        }
+        joinWakeUp.notify_all();
+    }
+    return true;
+}
+
+void Scheduler::blockUntilJoinable(const atomic<int>& nbPending) {
+    unique_lock<mutex> sleeping(sleepLock);
+    nbBlockedJoins++;
+    joinWakeUp.wait(sleeping, [&]() { return nbPending == 0 || nbQueued > 0; });
+    nbBlockedJoins--;
+}
+
+void Scheduler::workerLoop(int iWorker) {
+    workerId = iWorker;
+    while (true) {
+        if (runOne()) {
+            continue;
+        }
+        unique_lock<mutex> sleeping(sleepLock);
+        wakeUp.wait(sleeping, [&]() { return stopping || nbQueued > 0; });
+        if (stopping) {
+            return;
+        }
+    }
+}
+
+/*
+    Fork / join
+*/
+
+void TaskGroup::spawn(function<void()> fn) {
+    nbPending++;
+    scheduler().push(Task{move(fn), this});
+}
+
+void TaskGroup::wait() {
+    /* Runs tasks while there are some, then backs off when the remaining tasks of the group are running
+    on other threads: spins with exponentially more checks, yields, and finally blocks */
+    Scheduler& tasks = scheduler();
+    int nbIdleRounds = 0;
+    while (nbPending.load(memory_order_acquire) > 0) {
+        if (tasks.runOne()) {
+            nbIdleRounds = 0;
+        } else if (nbIdleRounds < JOIN_SPIN_ROUNDS) {
+            for (int iCheck = 0; iCheck < (1 << nbIdleRounds) && nbPending > 0 && tasks.nbQueued == 0; iCheck++) {
+            }
+            nbIdleRounds++;
+        } else if (nbIdleRounds < JOIN_SPIN_ROUNDS + JOIN_YIELD_ROUNDS) {
+            this_thread::yield();
+            nbIdleRounds++;
+        } else {
+            tasks.blockUntilJoinable(nbPending);
+        }
+    }
+}
+
+void parallelFor(int n, const function<void(int)>& fn) {
+    TaskGroup group;
+    for (int i = 0; i < n; i++) {
+        group.spawn([&fn, i]() { fn(i); });
+    }
+    group.wait();
+}
@@ -0,0 +1,69 @@
+#ifndef SCHEDULER_HPP
+#define SCHEDULER_HPP
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+/*
+    Work-stealing scheduler, shared by all the parallel searches.
+    Each worker has its own deque of tasks: it runs the last pushed one, and idle threads steal the oldest ones
+    of the others. A thread waiting for its tasks runs tasks too, so nested parallel searches do not
+    create more threads than the scheduler has.
+*/
+
+struct TaskGroup;
+
+struct Task {
+    std::function<void()> fn;
+    TaskGroup* group;
+};
+
+struct WorkerQueue {
+    std::mutex lock;
+    std::deque<Task> tasks;
+};
+
+struct Scheduler {
+    std::vector<std::unique_ptr<WorkerQueue>> queues; // One per worker, the last one for the other threads
+    std::vector<std::thread> workers;
+    std::atomic<int> nbQueued;
+    std::atomic<bool> stopping;
+    std::mutex sleepLock;
+    std::condition_variable wakeUp;
+    std::condition_variable joinWakeUp; // For the threads blocked in TaskGroup::wait
+    std::atomic<int> nbBlockedJoins;
+
+    Scheduler(int nThreads); // nThreads - 1 workers, the calling thread runs tasks when it waits
+    ~Scheduler();
+
+    int nThreads() const;
+    void push(Task task);
+    bool runOne(); // Run a task, from the own queue of the thread or stolen ; false if none was found
+    void blockUntilJoinable(const std::atomic<int>& nbPending); // Until a task is queued or nbPending is 0
+    void workerLoop(int iWorker);
+};
+
+Scheduler& scheduler();
+void setNumThreads(int nThreads); // Replace the scheduler, only when no task is running
+
+// Tasks forked together, and joined by wait
+struct TaskGroup {
+    std::atomic<int> nbPending;
+
+    TaskGroup() : nbPending(0) {}
+    ~TaskGroup() { wait(); }
+
+    void spawn(std::function<void()> fn);
+    void wait();
+};
+
+// Run fn(0), ..., fn(n-1) as tasks of the scheduler, and wait for all of them
+void parallelFor(int n, const std::function<void(int)>& fn);
+
+#endif
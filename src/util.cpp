@@ -1,3 +1,6 @@
+#include <thread>
+#include <cstdlib>
+
 #include "util.hpp"
 #include "maxsat.hpp"
 
@@ -16,4 +19,36 @@ std::ostream& operator<<(std::ostream& os, const Assignment& v) {
 std::ostream& operator<<(std::ostream& os, const Literal& v) {
     os << v.varId << "_" << v.isTrue;
     return os;
-}
\ No newline at end of file
+}
+
+
+/*
+    Random numbers, with an independent generator for each thread
+*/
+
+thread_local std::mt19937 randGenerator;
+
+void seedRandom(unsigned int seed) {
+    randGenerator.seed(seed);
+}
+
+std::mt19937& randomGenerator() {
+    return randGenerator;
+}
+
+unsigned int streamSeed(unsigned int seed, uint64_t stream) {
+    // SplitMix64 finalizer, so that close streams get unrelated seeds
+    uint64_t z = ((uint64_t)seed << 32) + stream * 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return (unsigned int)(z ^ (z >> 31));
+}
+
+int randInt() {
+    return randGenerator() % ((unsigned int)RAND_MAX + 1);
+}
+
+float randFloat() {
+    return randInt() / (float)RAND_MAX;
+}
+
@@ -4,6 +4,8 @@
 #include <ostream>
 #include <iostream>
 #include <vector>
+#include <functional>
+#include <random>
 
 #include "maxsat.hpp"
 
@@ -34,4 +36,16 @@ template<>
 std::ostream& operator<<(std::ostream& os, const Assignment& v);
 std::ostream& operator<<(std::ostream& os, const Literal& v);
 
+
+/*
+    Random numbers, with an independent generator for each thread
+*/
+
+void seedRandom(unsigned int seed);
+unsigned int streamSeed(unsigned int seed, uint64_t stream); // Seed of the stream-th independent stream
+std::mt19937& randomGenerator(); // Generator of the calling thread, can be saved and restored
+int randInt(); // Uniform in [0, RAND_MAX]
+float randFloat(); // Uniform in [0, 1]
+
+
 #endif
\ No newline at end of file